@@ -34,6 +34,45 @@
 // This should always be a power of two for performance reasons.
 #define DYNAMIC_SIZE_MIN    16
 
+// How many elements ahead foreach_prefetch looks, when asked to pick for
+// itself. It should cover one memory latency's worth of iterations.
+#define PREFETCH_DISTANCE   8
+
+// Aligned mode: define ARRAY_ALIGNMENT as 32 (one AVX register) or 64 (one
+// cache line) and both halves will start on that boundary. Vector kernels may
+// then use aligned loads, and as long as sizeof(Value) divides the alignment,
+// no element will ever straddle a cache line.
+//
+// The cost is the header growing from 40 bytes to offsetof(Array,
+// static_elems), which is 40 rounded up to ARRAY_ALIGNMENT: 64 bytes for
+// either alignment. The dynamic half also loses realloc's ability to grow in
+// place.
+#ifdef ARRAY_ALIGNMENT
+_Static_assert(ARRAY_ALIGNMENT == 32 || ARRAY_ALIGNMENT == 64,
+               "ARRAY_ALIGNMENT must be 32 or 64");
+_Static_assert(ARRAY_ALIGNMENT % sizeof(Value) == 0
+            || sizeof(Value) % ARRAY_ALIGNMENT == 0,
+               "Values would straddle an ARRAY_ALIGNMENT boundary");
+#define ARRAY_ALIGNAS       _Alignas(ARRAY_ALIGNMENT)
+#else
+#define ARRAY_ALIGNAS
+#endif
+
+// Define VALUE_TRIVIALLY_DESTRUCTIBLE as 1 when destroy(Value*) is the empty
+// default destructor. The compiler always knows this about a type, and uses
+// it to drop the element-destruction pass entirely. Every container's
+// destroy honors it, either through destroy_elems() below or by checking it
+// directly when its elements aren't contiguous.
+#ifndef VALUE_TRIVIALLY_DESTRUCTIBLE
+#define VALUE_TRIVIALLY_DESTRUCTIBLE 0
+#endif
+
+// The dynamic half may also be borrowed: pointing into memory the Array
+// doesn't own, such as a file mapped in by serialize.c. A borrowed dynamic
+// half is marked by a dynamic_capacity of zero with dynamic_elems set. It is
+// never freed or realloc'd: the first operation that would grow or shrink it
+// makes an owned copy instead. Elements may still be written in place through
+// index(), so mapped memory should be mapped copy-on-write (MAP_PRIVATE).
 struct Array
 {
     size_t dynamic_length;
@@ -42,15 +81,71 @@ struct Array
 
     size_t static_length;
     size_t static_capacity;
-    Value static_elems[];
+    // In aligned mode, this pads the header out to a multiple of
+    // ARRAY_ALIGNMENT bytes.
+    ARRAY_ALIGNAS Value static_elems[];
 };
 
+// Allocates room for `n' elements of the dynamic half.
+static Value* alloc_dynamic(size_t n)
+{
+#ifdef ARRAY_ALIGNMENT
+    // aligned_alloc requires the size to be a multiple of the alignment.
+    size_t bytes = n * sizeof(Value);
+    bytes = (bytes + ARRAY_ALIGNMENT - 1) & ~(size_t)(ARRAY_ALIGNMENT - 1);
+    return aligned_alloc(ARRAY_ALIGNMENT, bytes);
+#else
+    return malloc(n * sizeof(Value));
+#endif
+}
+
+static bool is_borrowed(Array* a)
+{
+    return a->dynamic_capacity == 0 && a->dynamic_elems != NULL;
+}
+
 static void resize_dynamic(Array* a, size_t newlen)
 {
     assert(a->dynamic_length <= newlen);
 
+    // Releasing the dynamic half is done by hand, not with realloc(p, 0): that
+    // may return a non-NULL pointer, which with a zero capacity would then
+    // look borrowed, and never be freed.
+    if(newlen == 0)
+    {
+        if(!is_borrowed(a))
+            free(a->dynamic_elems);
+
+        a->dynamic_elems = NULL;
+        a->dynamic_capacity = 0;
+        return;
+    }
+
+    if(is_borrowed(a))
+    {
+        // Copy out of the borrowed memory, and leave it be.
+        // BUG: No OOM checking.
+        Value* new_mem = alloc_dynamic(newlen);
+        memcpy(new_mem, a->dynamic_elems, a->dynamic_length * sizeof(Value));
+
+        a->dynamic_elems = new_mem;
+        a->dynamic_capacity = newlen;
+        return;
+    }
+
+#ifdef ARRAY_ALIGNMENT
+    // There is no aligned realloc, so we always move. Only the live elements
+    // need to come along.
+    // BUG: No OOM checking.
+    Value* new_mem = alloc_dynamic(newlen);
+    memcpy(new_mem, a->dynamic_elems, a->dynamic_length * sizeof(Value));
+
+    free(a->dynamic_elems);
+    a->dynamic_elems = new_mem;
+#else
     // BUG: No OOM checking.
     a->dynamic_elems = realloc(a->dynamic_elems, newlen * sizeof(Value));
+#endif
     a->dynamic_capacity = newlen;
 }
 
@@ -84,6 +179,20 @@ void reserve(Array* a, size_t capacity)
 //     mov rdi, rsp // assumes the array is at the top of the stack.
 //     call Array.destroy
 //     add rsp, len
+//
+// In aligned mode, the header is offsetof(Array, static_elems) bytes rather
+// than 5*sizeof(size_t). That is 5*sizeof(size_t) rounded up to
+// ARRAY_ALIGNMENT, so 64 whether the alignment is 32 or 64. The stack must
+// also be realigned before the array is placed on it:
+//
+//   #define len(requested_size) (offsetof(Array, static_elems) + requested_size*sizeof(Value))
+//     push rbp
+//     mov rbp, rsp
+//     sub rsp, len
+//     and rsp, -ARRAY_ALIGNMENT
+//     ...
+//     mov rsp, rbp // instead of `add rsp, len'
+//     pop rbp
 void init(Array* a)
 {
     a->dynamic_length = 0;
@@ -95,22 +204,45 @@ void init(Array* a)
     // a->static_elems can be left undefined.
 }
 
+// Destroys `n' contiguous elements. The destructor is called directly, not
+// through a pointer, so it can be inlined into the loop and the whole batch
+// unrolled or vectorized. The other containers share this, rather than each
+// keeping a copy.
+void destroy_elems(Value* v, size_t n)
+{
+#if !VALUE_TRIVIALLY_DESTRUCTIBLE
+    for(size_t i = 0; i < n; ++i)
+        destroy(&v[i]);
+#else
+    (void)v;
+    (void)n;
+#endif
+}
+
 void destroy(Array* a)
 {
+    destroy_elems(a->static_elems, a->static_length);
+    destroy_elems(a->dynamic_elems, a->dynamic_length);
+
     // free() checks this condition too, but by pulling it out of the library,
     // we give the compiler a chance to statically prove that the call is not
     // needed.
-    if(a->dynamic_elems)
+    if(a->dynamic_capacity)
         free(a->dynamic_elems);
 }
 
 void pcopy(Array* a)
 {
-    if(a->dynamic_elems)
+    if(is_borrowed(a))
+    {
+        // The copy owns its dynamic half.
+        resize_dynamic(a, a->dynamic_length);
+    }
+    else if(a->dynamic_elems)
     {
         // BUG: No OOM checking.
         size_t dynamic_bytes = a->dynamic_capacity * sizeof(Value);
-        Value* new_mem = malloc(dynamic_bytes);
+        Value* new_mem = alloc_dynamic(a->dynamic_capacity);
         memcpy(new_mem, a->dynamic_elems, dynamic_bytes);
         a->dynamic_elems = new_mem;
     }
@@ -122,6 +254,155 @@ void pcopy(Array* a)
         pcopy(&a->dynamic_elems[i]);
 }
 
+// A detached Array's contents, in transit between threads. Nothing in it
+// points into any stack frame, so it may be passed through a queue by value.
+// It MUST be either attached or destroyed, exactly once.
+struct ArrayBuffer
+{
+    // The static half, moved to the heap. NULL when it was empty.
+    size_t static_length;
+    Value* static_elems;
+
+    // The dynamic half, exactly as it was in the Array.
+    size_t dynamic_length;
+    size_t dynamic_capacity;
+    Value* dynamic_elems;
+};
+
+// Moves the contents of `a' out into a buffer, leaving `a' empty. The dynamic
+// half is handed over as-is; only the static half, which lives on this
+// thread's stack, is copied.
+//
+// The dynamic half came from malloc (or aligned_alloc), which may be freed by
+// any thread, so whichever thread ends up owning it may release it.
+ArrayBuffer transfer(Array* a)
+{
+    ArrayBuffer ret;
+
+    ret.static_length = a->static_length;
+    ret.static_elems = NULL;
+    if(a->static_length)
+    {
+        // BUG: No OOM checking.
+        ret.static_elems = malloc(a->static_length * sizeof(Value));
+        memcpy(ret.static_elems, a->static_elems,
+               a->static_length * sizeof(Value));
+    }
+
+    ret.dynamic_length = a->dynamic_length;
+    ret.dynamic_capacity = a->dynamic_capacity;
+    ret.dynamic_elems = a->dynamic_elems;
+
+    a->static_length = 0;
+    a->dynamic_length = 0;
+    a->dynamic_capacity = 0;
+    a->dynamic_elems = NULL;
+
+    return ret;
+}
+
+// Moves the contents of `buf' into `a', which MUST be empty. The buffer's
+// dynamic half becomes the Array's, without copying. Any dynamic half `a'
+// already owns (from reserve(), say) is freed first.
+//
+// The elements still have to be split at a->static_capacity, which needn't be
+// where the sending Array split them. When the two Arrays were declared alike
+// the split is the same, and only the static half is copied. Otherwise, the
+// elements that land on the other side of the split are moved across, and
+// the whole dynamic half is shifted along with a memmove to make room or
+// close the gap. That is an O(n) copy, just what transfer() exists to avoid,
+// so senders and receivers should declare their Arrays with the same static
+// capacity.
+void attach(Array* a, ArrayBuffer* buf)
+{
+    assert(length(a) == 0);
+
+    size_t s = buf->static_length;
+    size_t d = buf->dynamic_length;
+    size_t cap = a->static_capacity;
+
+    // An empty Array may still hold an allocation.
+    if(a->dynamic_capacity)
+        free(a->dynamic_elems);
+
+    a->dynamic_elems = buf->dynamic_elems;
+    a->dynamic_capacity = buf->dynamic_capacity;
+
+    // FASTPATH
+    if(s == cap || (s < cap && d == 0))
+    {
+        memcpy(a->static_elems, buf->static_elems, s * sizeof(Value));
+        a->static_length = s;
+        a->dynamic_length = d;
+    }
+    else if(s < cap)
+    {
+        // Fill the rest of the static half from the front of the dynamic half.
+        size_t moved = cap - s < d ? cap - s : d;
+
+        // A borrowed half may be read-only, so it is copied out before
+        // anything in it is shifted.
+        a->dynamic_length = d;
+        if(is_borrowed(a))
+            resize_dynamic(a, d);
+
+        memcpy(a->static_elems, buf->static_elems, s * sizeof(Value));
+        memcpy(a->static_elems + s, a->dynamic_elems, moved * sizeof(Value));
+        memmove(a->dynamic_elems, a->dynamic_elems + moved,
+                (d - moved) * sizeof(Value));
+
+        a->static_length = s + moved;
+        a->dynamic_length = d - moved;
+    }
+    else
+    {
+        // The static half overflows: its tail goes in front of the dynamic
+        // half.
+        size_t over = s - cap;
+
+        memcpy(a->static_elems, buf->static_elems, cap * sizeof(Value));
+        a->static_length = cap;
+
+        a->dynamic_length = d;
+        if(d + over > a->dynamic_capacity)
+            resize_dynamic(a, d + over < DYNAMIC_SIZE_MIN ? DYNAMIC_SIZE_MIN
+                                                          : d + over);
+
+        memmove(a->dynamic_elems + over, a->dynamic_elems, d * sizeof(Value));
+        memcpy(a->dynamic_elems, buf->static_elems + cap, over * sizeof(Value));
+        a->dynamic_length = d + over;
+    }
+
+    if(a->dynamic_length == 0 && a->dynamic_elems)
+    {
+        if(a->dynamic_capacity)
+            free(a->dynamic_elems);
+        a->dynamic_elems = NULL;
+        a->dynamic_capacity = 0;
+    }
+
+    if(buf->static_elems)
+        free(buf->static_elems);
+
+    buf->static_length = 0;
+    buf->static_elems = NULL;
+    buf->dynamic_length = 0;
+    buf->dynamic_capacity = 0;
+    buf->dynamic_elems = NULL;
+}
+
+// Drops a buffer that will never be attached, destroying its elements.
+void destroy(ArrayBuffer* buf)
+{
+    destroy_elems(buf->static_elems, buf->static_length);
+    destroy_elems(buf->dynamic_elems, buf->dynamic_length);
+
+    if(buf->static_elems)
+        free(buf->static_elems);
+    if(buf->dynamic_capacity)
+        free(buf->dynamic_elems);
+}
+
 // Note: the first two checks should be lifted into the parent function by the
 // optimizer.
 void append(Array* a, const Value* v)
@@ -139,9 +420,12 @@ void append(Array* a, const Value* v)
     else
     {
         // if the dynamic buffer is empty, create a small initial reservation.
-        // otherwise, double the size.
-        if(a->dynamic_capacity == 0)  reserve_dynamic(a, DYNAMIC_SIZE_MIN);
-        else                          reserve_dynamic(a, a->dynamic_capacity * 2);
+        // otherwise, double the size. A borrowed buffer is copied out at
+        // double its length.
+        if(is_borrowed(a))            resize_dynamic(a, a->dynamic_length * 2);
+        else if(a->dynamic_capacity == 0)
+                                      resize_dynamic(a, DYNAMIC_SIZE_MIN);
+        else                          resize_dynamic(a, a->dynamic_capacity * 2);
 
         a->dynamic_elems[a->dynamic_length++] = *v;
     }
@@ -156,18 +440,116 @@ void foreach(Array* a, void (*iter)(Value*, void*), void* aux)
         iter(a->dynamic_elems + i, aux);
 }
 
-// Returns a pointer to the value at index `i'.
-// This entire function should be inlined by the compiler.
-Value* index(Array* a, size_t i)
+// There are three flavors of index(), differing only in what they do with the
+// bounds check:
+//
+//   index_checked   - always checks, in every build type. An out-of-bounds
+//                     index is reported through the assert hook.
+//   index_unchecked - never checks. For inner loops whose bounds have already
+//                     been checked once, up front, with check_range().
+//   index_assume    - never checks, and tells the optimizer that `i' is in
+//                     bounds. Like an assert in a fast build.
+//
+// Plain index() picks one based on the build type (see "Compiler Options" in
+// the README): checked in debug, dev and release, and assume-only in fast.
+// Release builds keep their asserts on, so a hot loop there should hoist the
+// check out with check_range() and then use index_unchecked().
+
+static void index_out_of_bounds(Array* a, size_t i)
+    __attribute__((noreturn, cold));
+
+static void index_out_of_bounds(Array* a, size_t i)
 {
+    // Stands in for the release build's custom assert hook.
     assert(i < length(a));
+    abort();
+}
 
+// Returns a pointer to the value at index `i', without any bounds checking.
+// This entire function should be inlined by the compiler.
+Value* index_unchecked(Array* a, size_t i)
+{
     if(i < a->static_length)
         return &a->static_elems[i];
     else
         return &a->dynamic_elems[i - a->static_length];
 }
 
+Value* index_checked(Array* a, size_t i)
+{
+    if(__builtin_expect(i >= length(a), 0))
+        index_out_of_bounds(a, i);
+
+    return index_unchecked(a, i);
+}
+
+Value* index_assume(Array* a, size_t i)
+{
+    if(i >= length(a))
+        __builtin_unreachable();
+
+    return index_unchecked(a, i);
+}
+
+// Checks once that every index in [lo, hi) is in bounds, so that a loop over
+// that range may use index_unchecked(). An empty range touches nothing, so it
+// always passes.
+void check_range(Array* a, size_t lo, size_t hi)
+{
+    assert(lo <= hi);
+
+    if(__builtin_expect(lo < hi && hi > length(a), 0))
+        index_out_of_bounds(a, hi - 1);
+}
+
+// Returns a pointer to the value at index `i'.
+// This entire function should be inlined by the compiler.
+Value* index(Array* a, size_t i)
+{
+#ifdef BUILD_FAST
+    return index_assume(a, i);
+#else
+    return index_checked(a, i);
+#endif
+}
+
+// Like foreach, but for arrays of pointers or handles, where `iter' spends
+// most of its time waiting on the object each element refers to. `target'
+// maps an element to that object's address, and while `iter' works on
+// element i, the object behind element i + distance is already being
+// prefetched. The lookahead crosses from the static half into the dynamic
+// half on its own, independently of the element being visited.
+//
+// A `distance' of zero means PREFETCH_DISTANCE.
+void foreach_prefetch(Array* a, void (*iter)(Value*, void*),
+                      const void* (*target)(const Value*), size_t distance,
+                      void* aux)
+{
+    size_t n = length(a);
+
+    if(distance == 0)
+        distance = PREFETCH_DISTANCE;
+    if(distance > n)
+        distance = n;
+
+    // Get the first `distance' loads in flight before doing any work.
+    for(size_t j = 0; j < distance; ++j)
+        __builtin_prefetch(target(index_unchecked(a, j)), 0, 3);
+
+    // Steady state: one prefetch issued per element visited. Bounds were
+    // settled above, so there are no checks in here.
+    size_t i = 0;
+    for(; i + distance < n; ++i)
+    {
+        __builtin_prefetch(target(index_unchecked(a, i + distance)), 0, 3);
+        iter(index_unchecked(a, i), aux);
+    }
+
+    // The last `distance' elements have already been prefetched.
+    for(; i < n; ++i)
+        iter(index_unchecked(a, i), aux);
+}
+
 // Note: None of the removal functions call pcopy or any destructors.
 // There is no need, since the elements are being returned. If necessary, these
 // functions will be called in the parent scope.
@@ -195,7 +577,7 @@ Value remove_last(Array* a)
 
 // Removes an element from the array without preserving the order of the
 // elements.
-Value unordered_remove(Array* a, size_t index)
+Value unordered_remove(Array* a, size_t i)
 {
     // assumes swap(Value*, Value*) has been defined. Hopefully, swapping will
     // be a compiler builtin.
@@ -0,0 +1,150 @@
+// array_bench.c: Benchmarks the cost of bounds checking in tight loops.
+//
+// Each loop sums an Array through one flavor of index() (see array.c):
+//
+//   index      - whatever the build type picks.
+//   checked    - index_checked on every element.
+//   unchecked  - one check_range up front, then index_unchecked.
+//   assume     - index_assume on every element.
+//   halves     - no index() at all: a plain loop over each half in turn. This
+//                is the floor the others are measured against.
+//
+// A check costs a compare and a predictable branch, and can keep the compiler
+// from vectorizing the loop. Every flavor of index() also picks a half on
+// every element, which `halves' doesn't, so the gap between `unchecked' and
+// `halves' is the price of that choice rather than of any check. Build this
+// once per build type (for instance, once with BUILD_FAST defined and once
+// without) to compare them.
+//
+// Build it together with array.c, with Value as uint64_t.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Roughly how many elements each measurement visits, over repeated passes.
+#define BENCH_OPS           (1 << 28)
+
+// The static capacity of the benchmarked Arrays.
+#define BENCH_STATIC        64
+
+// One size that fits entirely in the static half, and one which is mostly
+// dynamic but still fits in cache, so that the loop itself is measured rather
+// than memory.
+static const size_t BENCH_SIZES[] = { BENCH_STATIC, 1 << 14 };
+
+// Results are summed into here, so the compiler can't drop the loops.
+static volatile uint64_t sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* mode, size_t n, double seconds, size_t ops)
+{
+    printf("%-10s n=%-6zu %6.3f ns/elem\n", mode, n,
+           seconds * 1e9 / (double)ops);
+}
+
+// Each loop is kept out of line, so that it is compiled on its own, the way
+// it would be in a real inner loop, and not merged into its caller.
+
+__attribute__((noinline))
+static uint64_t sum_index(Array* a)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < length(a); ++i)
+        sum += *index(a, i);
+    return sum;
+}
+
+__attribute__((noinline))
+static uint64_t sum_checked(Array* a)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < length(a); ++i)
+        sum += *index_checked(a, i);
+    return sum;
+}
+
+__attribute__((noinline))
+static uint64_t sum_unchecked(Array* a)
+{
+    size_t n = length(a);
+    check_range(a, 0, n);
+
+    uint64_t sum = 0;
+    for(size_t i = 0; i < n; ++i)
+        sum += *index_unchecked(a, i);
+    return sum;
+}
+
+__attribute__((noinline))
+static uint64_t sum_assume(Array* a)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < length(a); ++i)
+        sum += *index_assume(a, i);
+    return sum;
+}
+
+__attribute__((noinline))
+static uint64_t sum_halves(Array* a)
+{
+    uint64_t sum = 0;
+    for(size_t i = 0; i < a->static_length; ++i)
+        sum += a->static_elems[i];
+    for(size_t i = 0; i < a->dynamic_length; ++i)
+        sum += a->dynamic_elems[i];
+    return sum;
+}
+
+static void run(Array* a, const char* mode, uint64_t (*sum)(Array*))
+{
+    size_t n = length(a);
+    size_t reps = BENCH_OPS / n;
+    uint64_t total = 0;
+
+    double t = now();
+    for(size_t r = 0; r < reps; ++r)
+        total += sum(a);
+    report(mode, n, now() - t, reps * n);
+
+    sink += total;
+}
+
+int main(void)
+{
+    for(size_t s = 0; s < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]); ++s)
+    {
+        size_t n = BENCH_SIZES[s];
+
+        // What the stub in array.c does, in C: room for the header and the
+        // static half, with static_capacity set before init.
+        _Alignas(Array) char storage[sizeof(Array)
+                                     + BENCH_STATIC * sizeof(Value)];
+        Array* a = (Array*)storage;
+        a->static_capacity = BENCH_STATIC;
+        init(a);
+
+        for(size_t i = 0; i < n; ++i)
+        {
+            Value v = i;
+            append(a, &v);
+        }
+
+        run(a, "index", sum_index);
+        run(a, "checked", sum_checked);
+        run(a, "unchecked", sum_unchecked);
+        run(a, "assume", sum_assume);
+        run(a, "halves", sum_halves);
+
+        destroy(a);
+    }
+
+    return 0;
+}
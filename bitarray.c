@@ -0,0 +1,312 @@
+// bitarray.c: Defines NewLang's packed array of bools.
+//
+// The README only promises that a bool is true or false, and "no other
+// assumptions about its representation are made". That leaves the compiler
+// free to store an Array(bool) as a BitArray instead: one bit per element,
+// packed into 64-bit words, for an eighth of the memory of one byte per bool.
+// Scans get proportionally faster too, since population counts, searches and
+// bulk boolean operations all work on 64 elements per instruction.
+//
+// Otherwise, it is laid out exactly like an Array (see array.c). The static
+// half is allocated inline and holds static_capacity words; the dynamic half
+// is allocated on overflow and doubles as it fills. As with an Array, the
+// dynamic half is only used once the static half is full, so the dynamic
+// half always starts on a word boundary.
+//
+// Bits past the end of the array, in the last word of each half, are always
+// kept zero, so that whole-word operations never see garbage.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The minimum size of the dynamic half, in words, after the initial
+// allocation. This should always be a power of two for performance reasons.
+#define BIT_DYNAMIC_SIZE_MIN    4
+
+#define WORD_BITS               64
+
+struct BitArray
+{
+    // Lengths are in bits; capacities are in words.
+    size_t dynamic_length;
+    size_t dynamic_capacity;
+    uint64_t* dynamic_words;
+
+    size_t static_length;
+    size_t static_capacity;
+    uint64_t static_words[];
+};
+
+static size_t words_for(size_t bits)
+{
+    return (bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+static void resize_dynamic(BitArray* a, size_t newcap)
+{
+    assert(words_for(a->dynamic_length) <= newcap);
+
+    // BUG: No OOM checking.
+    a->dynamic_words = realloc(a->dynamic_words, newcap * sizeof(uint64_t));
+    a->dynamic_capacity = newcap;
+}
+
+// Returns a pointer to word `w', and sets `run' to how many words from there
+// on are contiguous in the same half.
+static uint64_t* word_run(BitArray* a, size_t w, size_t* run)
+{
+    if(w < a->static_capacity)
+    {
+        *run = a->static_capacity - w;
+        return &a->static_words[w];
+    }
+
+    *run = a->dynamic_capacity - (w - a->static_capacity);
+    return &a->dynamic_words[w - a->static_capacity];
+}
+
+// The number of words holding at least one bit of the array.
+static size_t word_count(BitArray* a)
+{
+    if(a->dynamic_length == 0)
+        return words_for(a->static_length);
+
+    return a->static_capacity + words_for(a->dynamic_length);
+}
+
+size_t length(BitArray* a)
+{
+    return a->static_length + a->dynamic_length;
+}
+
+// `a' MUST be allocated in the parent function with a stub like Array's,
+// where the header is offsetof(BitArray, static_words) bytes and each
+// requested word takes 8 bytes.
+void init(BitArray* a)
+{
+    a->dynamic_length = 0;
+    a->dynamic_capacity = 0;
+    a->dynamic_words = NULL;
+
+    a->static_length = 0;
+    // a->static_capacity was set in assembly.
+    // a->static_words is zeroed a word at a time, as bits are appended.
+}
+
+void destroy(BitArray* a)
+{
+    if(a->dynamic_words)
+        free(a->dynamic_words);
+}
+
+void pcopy(BitArray* a)
+{
+    if(a->dynamic_words)
+    {
+        // BUG: No OOM checking.
+        size_t dynamic_bytes = a->dynamic_capacity * sizeof(uint64_t);
+        uint64_t* new_mem = malloc(dynamic_bytes);
+        memcpy(new_mem, a->dynamic_words, dynamic_bytes);
+        a->dynamic_words = new_mem;
+    }
+}
+
+// Returns the word holding bit `i', and sets `bit' to its mask.
+static uint64_t* locate(BitArray* a, size_t i, uint64_t* bit)
+{
+    if(i >= a->static_length)
+    {
+        i -= a->static_length;
+        *bit = (uint64_t)1 << (i % WORD_BITS);
+        return &a->dynamic_words[i / WORD_BITS];
+    }
+
+    *bit = (uint64_t)1 << (i % WORD_BITS);
+    return &a->static_words[i / WORD_BITS];
+}
+
+void append(BitArray* a, bool v)
+{
+    uint64_t* w;
+    size_t i;
+
+    if(a->static_length < a->static_capacity * WORD_BITS)
+    {
+        i = a->static_length++;
+        w = &a->static_words[i / WORD_BITS];
+    }
+    else
+    {
+        if(a->dynamic_length == a->dynamic_capacity * WORD_BITS)
+        {
+            if(a->dynamic_capacity == 0)
+                resize_dynamic(a, BIT_DYNAMIC_SIZE_MIN);
+            else
+                resize_dynamic(a, a->dynamic_capacity * 2);
+        }
+
+        i = a->dynamic_length++;
+        w = &a->dynamic_words[i / WORD_BITS];
+    }
+
+    // Starting a new word: clear it, so that the bits past the end are zero.
+    if(i % WORD_BITS == 0)
+        *w = 0;
+
+    *w |= (uint64_t)v << (i % WORD_BITS);
+}
+
+bool get(BitArray* a, size_t i)
+{
+    assert(i < length(a));
+
+    uint64_t bit;
+    return (*locate(a, i, &bit) & bit) != 0;
+}
+
+void set(BitArray* a, size_t i, bool v)
+{
+    assert(i < length(a));
+
+    uint64_t bit;
+    uint64_t* w = locate(a, i, &bit);
+
+    // Branch-free: clear the bit, then or in the new value.
+    *w = (*w & ~bit) | (bit & -(uint64_t)v);
+}
+
+bool remove_last(BitArray* a)
+{
+    assert(length(a) > 0);
+
+    bool ret = get(a, length(a) - 1);
+
+    // Clear it, to keep the bits past the end zero.
+    set(a, length(a) - 1, false);
+
+    if(a->dynamic_length == 0)
+    {
+        --a->static_length;
+        return ret;
+    }
+
+    --a->dynamic_length;
+
+    if(a->dynamic_length == 0)
+    {
+        resize_dynamic(a, 0);
+    }
+    else if(words_for(a->dynamic_length) <= a->dynamic_capacity >> 2
+         && a->dynamic_capacity >> 1 >= BIT_DYNAMIC_SIZE_MIN)
+    {
+        resize_dynamic(a, a->dynamic_capacity >> 1);
+    }
+
+    return ret;
+}
+
+// Returns the number of true elements.
+size_t popcount(BitArray* a)
+{
+    size_t n = word_count(a);
+    size_t count = 0;
+
+    for(size_t w = 0; w < n; )
+    {
+        size_t run;
+        uint64_t* words = word_run(a, w, &run);
+        if(run > n - w)
+            run = n - w;
+
+        for(size_t k = 0; k < run; ++k)
+            count += (size_t)__builtin_popcountll(words[k]);
+
+        w += run;
+    }
+
+    return count;
+}
+
+// Returns the index of the first true element at or after `from', or
+// length(a) if there is none. Skips 64 elements per word that is all false.
+size_t find_first_set(BitArray* a, size_t from)
+{
+    size_t len = length(a);
+    if(from >= len)
+        return len;
+
+    size_t n = word_count(a);
+
+    // Mask off the bits before `from' in its word, then scan whole words.
+    size_t w = from / WORD_BITS;
+    uint64_t mask = ~(uint64_t)0 << (from % WORD_BITS);
+
+    for(; w < n; )
+    {
+        size_t run;
+        uint64_t* words = word_run(a, w, &run);
+        if(run > n - w)
+            run = n - w;
+
+        for(size_t k = 0; k < run; ++k)
+        {
+            uint64_t bits = words[k] & mask;
+            mask = ~(uint64_t)0;
+
+            if(bits)
+                return (w + k) * WORD_BITS + (size_t)__builtin_ctzll(bits);
+        }
+
+        w += run;
+    }
+
+    return len;
+}
+
+enum BitOp { BIT_AND, BIT_OR, BIT_XOR };
+
+// Applies `op' to every word of `dst' and `src'. The two may split their
+// halves at different places, so the words are walked in runs which are
+// contiguous in both, and each run is a single tight (vectorizable) loop.
+static void bulk(BitArray* dst, BitArray* src, BitOp op)
+{
+    assert(length(dst) == length(src));
+
+    size_t n = word_count(dst);
+
+    for(size_t w = 0; w < n; )
+    {
+        size_t drun;
+        size_t srun;
+        uint64_t* d = word_run(dst, w, &drun);
+        const uint64_t* s = word_run(src, w, &srun);
+
+        size_t run = drun < srun ? drun : srun;
+        if(run > n - w)
+            run = n - w;
+
+        switch(op)
+        {
+        case BIT_AND:
+            for(size_t k = 0; k < run; ++k) d[k] &= s[k];
+            break;
+        case BIT_OR:
+            for(size_t k = 0; k < run; ++k) d[k] |= s[k];
+            break;
+        case BIT_XOR:
+            for(size_t k = 0; k < run; ++k) d[k] ^= s[k];
+            break;
+        }
+
+        w += run;
+    }
+}
+
+// `dst' = `dst' & `src'. Both MUST have the same length.
+void and_with(BitArray* dst, BitArray* src) { bulk(dst, src, BIT_AND); }
+
+// `dst' = `dst' | `src'. Both MUST have the same length.
+void or_with(BitArray* dst, BitArray* src) { bulk(dst, src, BIT_OR); }
+
+// `dst' = `dst' ^ `src'. Both MUST have the same length.
+void xor_with(BitArray* dst, BitArray* src) { bulk(dst, src, BIT_XOR); }
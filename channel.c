@@ -0,0 +1,407 @@
+// channel.c: Defines NewLang's bounded channel types.
+//
+// A channel hands Values from one thread to another through a fixed-size ring,
+// without a lock. It is the building block for pipelines like the README's
+// asynchronous HTTP server, where a request passes through several worker
+// pools on its way to a response. There are two flavors:
+//
+//   SpscChannel - one sender thread and one receiver thread. Each side owns
+//                 one index and only reads the other's, so a send or receive
+//                 is a load, a copy and a store: no read-modify-writes.
+//   MpmcChannel - any number of senders and receivers. Each slot carries a
+//                 sequence number saying whose turn it is (see Vyukov's
+//                 bounded MPMC queue), and each side claims slots with a CAS
+//                 on its index.
+//
+// Both are bounded: try_send fails when the ring is full, and try_recv fails
+// when it is empty. The caller decides whether to spin, yield or park.
+//
+// Every operation also comes in a batch form, which moves up to `n' elements
+// for one round of synchronization. Batching is what keeps the per-element
+// cost well under a microsecond when the channel is busy.
+//
+// The ring is preallocated once, at init, as a single cache-line-aligned
+// buffer. Channels are shared between threads, so unlike an Array they can't
+// keep any elements inline in a stack frame; and a ring of fixed capacity has
+// no use for Array's dynamic growth. Batches go to and from Arrays, though:
+// see send_all and recv_into.
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE  64
+
+// How many elements recv_into moves per batch.
+#define RECV_BATCH  64
+
+struct SpscChannel
+{
+    // Written only by the receiver.
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    // The receiver's last look at `tail', so that it rereads the sender's
+    // cache line only when it appears to have run out.
+    size_t tail_cache;
+
+    // Written only by the sender.
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    size_t head_cache;
+
+    // Read-only after init.
+    _Alignas(CACHE_LINE) size_t mask;
+    Value* slots;
+};
+
+struct MpmcSlot
+{
+    atomic_size_t seq;
+    Value value;
+};
+
+struct MpmcChannel
+{
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+
+    _Alignas(CACHE_LINE) size_t mask;
+    MpmcSlot* slots;
+};
+
+// Rounds `n' up to a power of two, so that positions wrap with a mask.
+static size_t ring_capacity(size_t n)
+{
+    size_t cap = 2;
+    while(cap < n)
+        cap *= 2;
+    return cap;
+}
+
+static void* alloc_ring(size_t bytes)
+{
+    // aligned_alloc requires the size to be a multiple of the alignment.
+    bytes = (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+
+    // BUG: No OOM checking.
+    return aligned_alloc(CACHE_LINE, bytes);
+}
+
+// Channels are initialized in place, wherever all of their threads can reach
+// them. The capacity is rounded up to a power of two.
+void init(SpscChannel* c, size_t capacity)
+{
+    size_t cap = ring_capacity(capacity);
+
+    atomic_init(&c->head, 0);
+    atomic_init(&c->tail, 0);
+    c->tail_cache = 0;
+    c->head_cache = 0;
+
+    c->mask = cap - 1;
+    c->slots = alloc_ring(cap * sizeof(Value));
+}
+
+// Destroys whatever is still in the channel. MUST only be called once both
+// threads are done with it.
+void destroy(SpscChannel* c)
+{
+    size_t head = atomic_load(&c->head);
+    size_t tail = atomic_load(&c->tail);
+
+    // At most two runs, either side of the wrap.
+    size_t start = head & c->mask;
+    size_t n = tail - head;
+    size_t first = c->mask + 1 - start < n ? c->mask + 1 - start : n;
+
+    destroy_elems(c->slots + start, first);
+    destroy_elems(c->slots, n - first);
+
+    free(c->slots);
+}
+
+// Sends up to `n' elements from `v', and returns how many fit. Like Array's
+// append, the channel takes the elements as they are, without pcopy.
+size_t send(SpscChannel* c, const Value* v, size_t n)
+{
+    size_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    size_t cap = c->mask + 1;
+
+    // FASTPATH
+    if(tail - c->head_cache + n > cap)
+        c->head_cache = atomic_load_explicit(&c->head, memory_order_acquire);
+
+    size_t room = cap - (tail - c->head_cache);
+    if(n > room)
+        n = room;
+
+    // Copy in at most two runs, either side of the wrap.
+    size_t start = tail & c->mask;
+    size_t first = cap - start < n ? cap - start : n;
+    memcpy(c->slots + start, v, first * sizeof(Value));
+    memcpy(c->slots, v + first, (n - first) * sizeof(Value));
+
+    atomic_store_explicit(&c->tail, tail + n, memory_order_release);
+    return n;
+}
+
+bool try_send(SpscChannel* c, const Value* v)
+{
+    return send(c, v, 1) == 1;
+}
+
+// Receives up to `n' elements into `out', and returns how many there were.
+size_t recv(SpscChannel* c, Value* out, size_t n)
+{
+    size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+    size_t cap = c->mask + 1;
+
+    // FASTPATH
+    if(c->tail_cache - head < n)
+        c->tail_cache = atomic_load_explicit(&c->tail, memory_order_acquire);
+
+    size_t avail = c->tail_cache - head;
+    if(n > avail)
+        n = avail;
+
+    size_t start = head & c->mask;
+    size_t first = cap - start < n ? cap - start : n;
+    memcpy(out, c->slots + start, first * sizeof(Value));
+    memcpy(out + first, c->slots, (n - first) * sizeof(Value));
+
+    atomic_store_explicit(&c->head, head + n, memory_order_release);
+    return n;
+}
+
+bool try_recv(SpscChannel* c, Value* out)
+{
+    return recv(c, out, 1) == 1;
+}
+
+void init(MpmcChannel* c, size_t capacity)
+{
+    size_t cap = ring_capacity(capacity);
+
+    atomic_init(&c->head, 0);
+    atomic_init(&c->tail, 0);
+
+    c->mask = cap - 1;
+    c->slots = alloc_ring(cap * sizeof(MpmcSlot));
+
+    // Slot i is first free for the sender claiming position i.
+    for(size_t i = 0; i < cap; ++i)
+        atomic_init(&c->slots[i].seq, i);
+}
+
+// MUST only be called once every thread is done with the channel.
+void destroy(MpmcChannel* c)
+{
+    size_t head = atomic_load(&c->head);
+    size_t tail = atomic_load(&c->tail);
+
+#if !VALUE_TRIVIALLY_DESTRUCTIBLE
+    for(size_t i = head; i != tail; ++i)
+        destroy(&c->slots[i & c->mask].value);
+#else
+    (void)head;
+    (void)tail;
+#endif
+
+    free(c->slots);
+}
+
+// Slot `pos' is ready for whichever side is waiting on `seq' == `want'. A
+// slot's sequence only moves forward, and only the side which claimed it
+// moves it on, so once it reads as ready it stays ready until claimed.
+static bool slot_ready(MpmcChannel* c, size_t pos, size_t want)
+{
+    return atomic_load_explicit(&c->slots[pos & c->mask].seq,
+                                memory_order_acquire) == want;
+}
+
+// Sends up to `n' elements from `v', and returns how many fit. The batch is
+// claimed with a single CAS, so its elements stay in order relative to each
+// other, and are received in order.
+size_t send(MpmcChannel* c, const Value* v, size_t n)
+{
+    // With nothing to move, k below could never leave zero, and the loop
+    // would take that for a lost race and spin.
+    if(n == 0)
+        return 0;
+
+    size_t pos = atomic_load_explicit(&c->tail, memory_order_relaxed);
+    size_t k;
+
+    for(;;)
+    {
+        // Count how many slots from `pos' on have been drained.
+        k = 0;
+        while(k < n && k <= c->mask && slot_ready(c, pos + k, pos + k))
+            ++k;
+
+        if(k == 0)
+        {
+            // Either the ring is full, or another sender got here first.
+            size_t seq = atomic_load_explicit(&c->slots[pos & c->mask].seq,
+                                              memory_order_acquire);
+            if(seq < pos)
+                return 0;
+
+            pos = atomic_load_explicit(&c->tail, memory_order_relaxed);
+            continue;
+        }
+
+        if(atomic_compare_exchange_weak_explicit(&c->tail, &pos, pos + k,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+            break;
+    }
+
+    for(size_t i = 0; i < k; ++i)
+    {
+        MpmcSlot* s = &c->slots[(pos + i) & c->mask];
+        s->value = v[i];
+        atomic_store_explicit(&s->seq, pos + i + 1, memory_order_release);
+    }
+
+    return k;
+}
+
+bool try_send(MpmcChannel* c, const Value* v)
+{
+    return send(c, v, 1) == 1;
+}
+
+// Receives up to `n' elements into `out', and returns how many there were.
+size_t recv(MpmcChannel* c, Value* out, size_t n)
+{
+    // With nothing to move, k below could never leave zero, and the loop
+    // would take that for a lost race and spin.
+    if(n == 0)
+        return 0;
+
+    size_t pos = atomic_load_explicit(&c->head, memory_order_relaxed);
+    size_t k;
+
+    for(;;)
+    {
+        // Count how many slots from `pos' on have been filled.
+        k = 0;
+        while(k < n && k <= c->mask && slot_ready(c, pos + k, pos + k + 1))
+            ++k;
+
+        if(k == 0)
+        {
+            // Either the ring is empty, or another receiver got here first.
+            size_t seq = atomic_load_explicit(&c->slots[pos & c->mask].seq,
+                                              memory_order_acquire);
+            if(seq < pos + 1)
+                return 0;
+
+            pos = atomic_load_explicit(&c->head, memory_order_relaxed);
+            continue;
+        }
+
+        if(atomic_compare_exchange_weak_explicit(&c->head, &pos, pos + k,
+                                                 memory_order_relaxed,
+                                                 memory_order_relaxed))
+            break;
+    }
+
+    for(size_t i = 0; i < k; ++i)
+    {
+        MpmcSlot* s = &c->slots[(pos + i) & c->mask];
+        out[i] = s->value;
+
+        // Hand the slot to the sender one lap ahead.
+        atomic_store_explicit(&s->seq, pos + i + c->mask + 1,
+                              memory_order_release);
+    }
+
+    return k;
+}
+
+bool try_recv(MpmcChannel* c, Value* out)
+{
+    return recv(c, out, 1) == 1;
+}
+
+// Sends as much of `a' as fits, in order, starting from element `from'.
+// Returns the index of the first element not sent. The static and dynamic
+// halves each go as one batch.
+size_t send_all(SpscChannel* c, Array* a, size_t from)
+{
+    size_t i = from;
+
+    if(i < a->static_length)
+    {
+        i += send(c, a->static_elems + i, a->static_length - i);
+        if(i < a->static_length)
+            return i;
+    }
+
+    size_t d = i - a->static_length;
+    if(d == a->dynamic_length)
+        return i;
+
+    return i + send(c, a->dynamic_elems + d, a->dynamic_length - d);
+}
+
+size_t send_all(MpmcChannel* c, Array* a, size_t from)
+{
+    size_t i = from;
+
+    if(i < a->static_length)
+    {
+        i += send(c, a->static_elems + i, a->static_length - i);
+        if(i < a->static_length)
+            return i;
+    }
+
+    size_t d = i - a->static_length;
+    if(d == a->dynamic_length)
+        return i;
+
+    return i + send(c, a->dynamic_elems + d, a->dynamic_length - d);
+}
+
+// Receives up to `max' elements, appending them to `a'. Returns how many
+// there were.
+size_t recv_into(SpscChannel* c, Array* a, size_t max)
+{
+    Value buf[RECV_BATCH];
+    size_t total = 0;
+
+    while(total < max)
+    {
+        size_t want = max - total < RECV_BATCH ? max - total : RECV_BATCH;
+        size_t got = recv(c, buf, want);
+
+        for(size_t i = 0; i < got; ++i)
+            append(a, &buf[i]);
+
+        total += got;
+        if(got < want)
+            break;
+    }
+
+    return total;
+}
+
+size_t recv_into(MpmcChannel* c, Array* a, size_t max)
+{
+    Value buf[RECV_BATCH];
+    size_t total = 0;
+
+    while(total < max)
+    {
+        size_t want = max - total < RECV_BATCH ? max - total : RECV_BATCH;
+        size_t got = recv(c, buf, want);
+
+        for(size_t i = 0; i < got; ++i)
+            append(a, &buf[i]);
+
+        total += got;
+        if(got < want)
+            break;
+    }
+
+    return total;
+}
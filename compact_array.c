@@ -0,0 +1,192 @@
+// compact_array.c: Defines NewLang's compact array type.
+//
+// A CompactArray is an Array (see array.c) with a smaller header, meant for
+// the case where a program holds millions of tiny arrays and the 40-byte
+// header of a full Array would outweigh the elements themselves.
+//
+// The layout is identical in spirit: a fixed-size static half that lives
+// wherever the array was allocated, followed by a heap-allocated dynamic half
+// that is only created on overflow. The differences are all in the header:
+//
+//   - The dynamic length and capacity are 32 bits wide. No compact array may
+//     hold more than 2^32 - 1 elements in its dynamic half.
+//   - The static length and capacity are 16 bits wide, and packed together
+//     into a single 32-bit word.
+//
+// This brings the header down to 20 bytes (24 after padding for 8-byte
+// Values), so that a whole array with several inline elements fits in one
+// cache line. COMPACT_STATIC_FIT is the number of inline elements which can be
+// requested before the array spills onto a second line.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The minimum size of the dynamic half after the initial allocation.
+// This should always be a power of two for performance reasons.
+#define COMPACT_DYNAMIC_SIZE_MIN    8
+
+#define COMPACT_DYNAMIC_MAX         UINT32_MAX
+#define COMPACT_STATIC_MAX          UINT16_MAX
+
+struct CompactArray
+{
+    Value* dynamic_elems;
+    uint32_t dynamic_length;
+    uint32_t dynamic_capacity;
+
+    uint16_t static_length;
+    uint16_t static_capacity;
+    Value static_elems[];
+};
+
+#define COMPACT_STATIC_FIT \
+    ((64 - offsetof(CompactArray, static_elems)) / sizeof(Value))
+
+static void resize_dynamic(CompactArray* a, uint32_t newlen)
+{
+    assert(a->dynamic_length <= newlen);
+
+    // BUG: No OOM checking.
+    a->dynamic_elems = realloc(a->dynamic_elems, (size_t)newlen * sizeof(Value));
+    a->dynamic_capacity = newlen;
+}
+
+size_t length(CompactArray* a)
+{
+    return (size_t)a->static_length + a->dynamic_length;
+}
+
+void reserve(CompactArray* a, size_t capacity)
+{
+    if(capacity <= length(a))
+        return;
+
+    if(capacity <= a->static_capacity)
+        return;
+
+    assert(capacity - a->static_capacity <= COMPACT_DYNAMIC_MAX);
+    resize_dynamic(a, (uint32_t)(capacity - a->static_capacity));
+}
+
+// `a' MUST be allocated in the parent function with the following stub:
+//
+//   #define hdr offsetof(CompactArray, static_elems)
+//   #define cap offsetof(CompactArray, static_capacity)
+//   #define len(requested_size) (hdr + requested_size*sizeof(Value))
+//     sub rsp, len
+//     mov word [rsp+cap], requested_size // set up static_capacity
+//     mov rdi, rsp // pass the newly allocated struct to CompactArray.init
+//     call CompactArray.init
+//
+// where requested_size <= COMPACT_STATIC_MAX. It is deallocated the same way
+// as an Array.
+void init(CompactArray* a)
+{
+    a->dynamic_elems = NULL;
+    a->dynamic_length = 0;
+    a->dynamic_capacity = 0;
+
+    a->static_length = 0;
+    // a->static_capacity was set in assembly.
+    // a->static_elems can be left undefined.
+}
+
+void destroy(CompactArray* a)
+{
+    destroy_elems(a->static_elems, a->static_length);
+    destroy_elems(a->dynamic_elems, a->dynamic_length);
+
+    if(a->dynamic_elems)
+        free(a->dynamic_elems);
+}
+
+void pcopy(CompactArray* a)
+{
+    if(a->dynamic_elems)
+    {
+        // BUG: No OOM checking.
+        size_t dynamic_bytes = (size_t)a->dynamic_capacity * sizeof(Value);
+        Value* new_mem = malloc(dynamic_bytes);
+        memcpy(new_mem, a->dynamic_elems, dynamic_bytes);
+        a->dynamic_elems = new_mem;
+    }
+
+    for(uint16_t i = 0; i < a->static_length; ++i)
+        pcopy(&a->static_elems[i]);
+    for(uint32_t i = 0; i < a->dynamic_length; ++i)
+        pcopy(&a->dynamic_elems[i]);
+}
+
+void append(CompactArray* a, const Value* v)
+{
+    if(a->static_length < a->static_capacity)
+        a->static_elems[a->static_length++] = *v;
+
+    else if(a->dynamic_length < a->dynamic_capacity)
+        a->dynamic_elems[a->dynamic_length++] = *v;
+
+    else
+    {
+        assert(a->dynamic_length < COMPACT_DYNAMIC_MAX);
+
+        // Doubling is clamped so that the capacity never wraps.
+        if(a->dynamic_capacity == 0)
+            resize_dynamic(a, COMPACT_DYNAMIC_SIZE_MIN);
+        else if(a->dynamic_capacity > COMPACT_DYNAMIC_MAX / 2)
+            resize_dynamic(a, COMPACT_DYNAMIC_MAX);
+        else
+            resize_dynamic(a, a->dynamic_capacity * 2);
+
+        a->dynamic_elems[a->dynamic_length++] = *v;
+    }
+}
+
+void foreach(CompactArray* a, void (*iter)(Value*, void*), void* aux)
+{
+    for(uint16_t i = 0; i < a->static_length; ++i)
+        iter(a->static_elems + i, aux);
+
+    for(uint32_t i = 0; i < a->dynamic_length; ++i)
+        iter(a->dynamic_elems + i, aux);
+}
+
+// Returns a pointer to the value at index `i'.
+// This entire function should be inlined by the compiler.
+Value* index(CompactArray* a, size_t i)
+{
+    assert(i < length(a));
+
+    if(i < a->static_length)
+        return &a->static_elems[i];
+    else
+        return &a->dynamic_elems[i - a->static_length];
+}
+
+Value remove_last(CompactArray* a)
+{
+    // FASTPATH
+    if(a->dynamic_length == 0)
+        return a->static_elems[--a->static_length];
+
+    Value ret = a->dynamic_elems[--a->dynamic_length];
+
+    if(a->dynamic_length == 0)
+    {
+        resize_dynamic(a, 0);
+    }
+    else if(a->dynamic_length <= a->dynamic_capacity >> 2
+         && a->dynamic_length >= COMPACT_DYNAMIC_SIZE_MIN)
+    {
+        resize_dynamic(a, a->dynamic_capacity >> 1);
+    }
+
+    return ret;
+}
+
+// Removes an element from the array without preserving the order of the
+// elements.
+Value unordered_remove(CompactArray* a, size_t i)
+{
+    swap(index(a, i), index(a, length(a) - 1));
+    return remove_last(a);
+}
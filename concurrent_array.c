@@ -0,0 +1,264 @@
+// concurrent_array.c: Defines NewLang's multi-producer array type.
+//
+// A ConcurrentArray may be appended to by any number of threads at once,
+// without a lock. It is laid out like the dynamic half of a SegmentedArray
+// (see segmented_array.c): a fixed table of chunks, each twice the size of
+// the one before, so that no element ever moves once it has been written.
+//
+// Appending is two steps:
+//   1. Claim a slot, with one atomic fetch-and-add on `reserved'. Every
+//      producer gets a distinct slot, and batches claim a whole range at once.
+//   2. Write the element into the slot, then mark it ready with a release
+//      store. The chunk holding the slot is allocated by whichever producer
+//      gets there first; a producer which loses that race frees its copy.
+//
+// Slots are filled out of order, so readers only see the published prefix:
+// the longest run of ready slots from the start. published_length() advances
+// it, and everything below it may be read (by any thread) without further
+// synchronization, since elements never move and are never written twice.
+//
+// There is no static half: the array is shared between threads, so it must
+// outlive any one stack frame, and inline elements would need the same
+// ready flags anyway.
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// The size of the first chunk. This MUST be a power of two, since locate()
+// relies on it.
+#define CONCURRENT_CHUNK_MIN        64
+#define CONCURRENT_CHUNK_MIN_LOG2   6
+
+// Enough chunks for 2^(CONCURRENT_CHUNK_MIN_LOG2 + CONCURRENT_CHUNKS_MAX)
+// elements, which is more than any address space holds.
+#define CONCURRENT_CHUNKS_MAX       48
+
+#define CACHE_LINE                  64
+
+struct ConcurrentChunk
+{
+    // One flag per slot, set once its element has been written.
+    atomic_bool* ready;
+    Value* elems;
+};
+
+struct ConcurrentArray
+{
+    // Producers hammer `reserved', and readers hammer `published'. They are
+    // kept on separate cache lines so that each doesn't slow the other down.
+    _Alignas(CACHE_LINE) atomic_size_t reserved;
+    _Alignas(CACHE_LINE) atomic_size_t published;
+
+    _Alignas(CACHE_LINE) _Atomic(ConcurrentChunk*) chunks[CONCURRENT_CHUNKS_MAX];
+};
+
+static size_t chunk_start(size_t k)
+{
+    return CONCURRENT_CHUNK_MIN * (((size_t)1 << k) - 1);
+}
+
+static size_t chunk_size(size_t k)
+{
+    return (size_t)CONCURRENT_CHUNK_MIN << k;
+}
+
+// Splits `i' into its chunk number and the offset within that chunk. See
+// dynamic_index() in segmented_array.c.
+static size_t locate(size_t i, size_t* offset)
+{
+    size_t t = i + CONCURRENT_CHUNK_MIN;
+    size_t top = (sizeof(size_t) * 8 - 1) - __builtin_clzl(t);
+
+    *offset = t - ((size_t)1 << top);
+    return top - CONCURRENT_CHUNK_MIN_LOG2;
+}
+
+static ConcurrentChunk* new_chunk(size_t k)
+{
+    size_t n = chunk_size(k);
+
+    // BUG: No OOM checking.
+    ConcurrentChunk* c = malloc(sizeof(ConcurrentChunk));
+    c->ready = calloc(n, sizeof(atomic_bool));
+    c->elems = malloc(n * sizeof(Value));
+    return c;
+}
+
+static void free_chunk(ConcurrentChunk* c)
+{
+    free(c->ready);
+    free(c->elems);
+    free(c);
+}
+
+// Returns chunk `k', allocating it if no thread has yet.
+static ConcurrentChunk* get_chunk(ConcurrentArray* a, size_t k)
+{
+    assert(k < CONCURRENT_CHUNKS_MAX);
+
+    // FASTPATH
+    ConcurrentChunk* c = atomic_load_explicit(&a->chunks[k],
+                                              memory_order_acquire);
+    if(c)
+        return c;
+
+    ConcurrentChunk* mine = new_chunk(k);
+    if(atomic_compare_exchange_strong_explicit(&a->chunks[k], &c, mine,
+                                               memory_order_acq_rel,
+                                               memory_order_acquire))
+        return mine;
+
+    // Another producer installed one first; `c' now holds it.
+    free_chunk(mine);
+    return c;
+}
+
+// Writes `v' into slot `i', which the caller has claimed, and publishes it.
+static void fill(ConcurrentArray* a, size_t i, const Value* v)
+{
+    size_t offset;
+    ConcurrentChunk* c = get_chunk(a, locate(i, &offset));
+
+    c->elems[offset] = *v;
+    atomic_store_explicit(&c->ready[offset], true, memory_order_release);
+}
+
+static bool is_ready(ConcurrentArray* a, size_t i)
+{
+    size_t offset;
+    size_t k = locate(i, &offset);
+
+    ConcurrentChunk* c = atomic_load_explicit(&a->chunks[k],
+                                              memory_order_acquire);
+    return c && atomic_load_explicit(&c->ready[offset], memory_order_acquire);
+}
+
+// Unlike other containers, a ConcurrentArray is initialized in place, wherever
+// all of its threads can reach it.
+void init(ConcurrentArray* a)
+{
+    atomic_init(&a->reserved, 0);
+    atomic_init(&a->published, 0);
+
+    for(size_t k = 0; k < CONCURRENT_CHUNKS_MAX; ++k)
+        atomic_init(&a->chunks[k], NULL);
+}
+
+// MUST only be called once every producer has finished, and every slot it
+// claimed has been filled.
+void destroy(ConcurrentArray* a)
+{
+    size_t n = atomic_load(&a->reserved);
+
+    for(size_t k = 0; chunk_start(k) < n; ++k)
+    {
+        size_t run = n - chunk_start(k);
+        if(run > chunk_size(k))
+            run = chunk_size(k);
+
+        destroy_elems(a->chunks[k]->elems, run);
+    }
+
+    for(size_t k = 0; k < CONCURRENT_CHUNKS_MAX; ++k)
+        if(a->chunks[k])
+            free_chunk(a->chunks[k]);
+}
+
+// Appends `v', and returns the index it was stored at. Safe to call from any
+// number of threads at once.
+size_t append(ConcurrentArray* a, const Value* v)
+{
+    size_t i = atomic_fetch_add_explicit(&a->reserved, 1, memory_order_relaxed);
+    fill(a, i, v);
+    return i;
+}
+
+// Appends the `n' elements at `v' as one contiguous run, and returns the index
+// of the first. The whole run costs a single atomic add.
+size_t append(ConcurrentArray* a, const Value* v, size_t n)
+{
+    size_t first = atomic_fetch_add_explicit(&a->reserved, n,
+                                             memory_order_relaxed);
+
+    for(size_t i = 0; i < n; )
+    {
+        size_t offset;
+        size_t k = locate(first + i, &offset);
+        ConcurrentChunk* c = get_chunk(a, k);
+
+        // Copy as much as fits in this chunk in one go, then publish it.
+        size_t run = chunk_size(k) - offset;
+        if(run > n - i)
+            run = n - i;
+
+        memcpy(c->elems + offset, v + i, run * sizeof(Value));
+        for(size_t j = 0; j < run; ++j)
+            atomic_store_explicit(&c->ready[offset + j], true,
+                                  memory_order_release);
+
+        i += run;
+    }
+
+    return first;
+}
+
+// Returns the length of the published prefix: every element below it has
+// been written, and may be read. This only ever grows.
+//
+// Readers share the work of advancing it. Each one picks up where the last
+// left off, walks forward over ready slots, and then raises `published' to
+// wherever it stopped.
+size_t published_length(ConcurrentArray* a)
+{
+    size_t p = atomic_load_explicit(&a->published, memory_order_acquire);
+    size_t end = atomic_load_explicit(&a->reserved, memory_order_relaxed);
+
+    // FASTPATH
+    if(p == end)
+        return p;
+
+    size_t q = p;
+    while(q < end && is_ready(a, q))
+        ++q;
+
+    while(p < q
+       && !atomic_compare_exchange_weak_explicit(&a->published, &p, q,
+                                                 memory_order_release,
+                                                 memory_order_acquire))
+        ;
+
+    return p > q ? p : q;
+}
+
+// Returns a pointer to element `i', which MUST be below the published prefix.
+// The pointer stays valid until the array is destroyed.
+Value* index(ConcurrentArray* a, size_t i)
+{
+    assert(i < atomic_load_explicit(&a->published, memory_order_acquire));
+
+    size_t offset;
+    ConcurrentChunk* c = atomic_load_explicit(&a->chunks[locate(i, &offset)],
+                                              memory_order_relaxed);
+    return &c->elems[offset];
+}
+
+// Calls `iter' on every element of the published prefix, as of the call.
+// Elements appended meanwhile are not visited. Safe to call while producers
+// are still appending.
+void foreach(ConcurrentArray* a, void (*iter)(Value*, void*), void* aux)
+{
+    size_t n = published_length(a);
+
+    for(size_t k = 0; chunk_start(k) < n; ++k)
+    {
+        ConcurrentChunk* c = atomic_load_explicit(&a->chunks[k],
+                                                  memory_order_relaxed);
+
+        size_t run = n - chunk_start(k);
+        if(run > chunk_size(k))
+            run = chunk_size(k);
+
+        for(size_t i = 0; i < run; ++i)
+            iter(c->elems + i, aux);
+    }
+}
@@ -0,0 +1,224 @@
+// deque.c: Defines NewLang's double-ended queue type.
+//
+// A Deque is a ring buffer which borrows the static half from array.c: it is
+// constructed on the stack with a fixed amount of inline storage, and only
+// moves to the heap once that storage runs out. Unlike an Array, the deque
+// does not keep two halves in use at once. A ring split across two buffers
+// would need a branch and a subtraction on every access, so when the inline
+// ring overflows, the whole ring is moved into a heap buffer of double the
+// size, and the inline storage goes unused until the deque shrinks again.
+//
+// All four of push_front, pop_front, push_back and pop_back are O(1) (the
+// pushes amortized) and never allocate unless the ring is full. Work queues
+// should use this, rather than unordered_remove(a, 0) on an Array, which
+// reorders the queue, or shifting every element down by one.
+#include <stddef.h>
+#include <stdbool.h>
+
+// The minimum size of the ring once it has moved to the heap.
+// This should always be a power of two for performance reasons.
+#define DEQUE_SIZE_MIN      16
+
+struct Deque
+{
+    // NULL while the ring lives in static_elems. We can't just point this at
+    // static_elems, since the compiler is free to copy the struct around.
+    Value* dynamic_elems;
+    size_t head;
+    size_t length;
+    size_t capacity;
+
+    size_t static_capacity;
+    Value static_elems[];
+};
+
+static Value* storage(Deque* d)
+{
+    return d->dynamic_elems ? d->dynamic_elems : d->static_elems;
+}
+
+// Maps a logical position to a physical slot. `i' is always less than twice
+// the capacity, so a conditional subtraction is enough, and the capacity need
+// not be a power of two (static_capacity is whatever the caller asked for).
+static size_t wrap(Deque* d, size_t i)
+{
+    return i >= d->capacity ? i - d->capacity : i;
+}
+
+// Moves the ring into a buffer of `newcap' elements, unwrapping it so that
+// the head lands at slot zero. A NULL `dst' moves it back to static_elems.
+static void move_ring(Deque* d, Value* dst, size_t newcap)
+{
+    assert(d->length <= newcap);
+
+    Value* src = storage(d);
+    Value* to = dst ? dst : d->static_elems;
+
+    // The live elements are at most two runs: [head, capacity) and [0, rest).
+    size_t first = d->capacity - d->head;
+    if(first > d->length)
+        first = d->length;
+
+    memmove(to, src + d->head, first * sizeof(Value));
+    memmove(to + first, src, (d->length - first) * sizeof(Value));
+
+    if(d->dynamic_elems)
+        free(d->dynamic_elems);
+
+    d->dynamic_elems = dst;
+    d->head = 0;
+    d->capacity = newcap;
+}
+
+static void grow(Deque* d)
+{
+    size_t newcap = d->capacity * 2;
+    if(newcap < DEQUE_SIZE_MIN)
+        newcap = DEQUE_SIZE_MIN;
+
+    // BUG: No OOM checking.
+    move_ring(d, malloc(newcap * sizeof(Value)), newcap);
+}
+
+// Called after every pop. Halves the heap ring once it is a quarter full, and
+// moves back into the static storage once it would be at most half full
+// there. Moving back as soon as it merely fits would leave the inline ring
+// full, so that the next push moves it straight back out: alternating pushes
+// and pops at the boundary would malloc and free on every operation.
+static void maybe_shrink(Deque* d)
+{
+    if(d->dynamic_elems == NULL)
+        return;
+
+    if(d->length <= d->static_capacity / 2)
+    {
+        move_ring(d, NULL, d->static_capacity);
+    }
+    else if(d->length <= d->capacity >> 2
+         && d->capacity >> 1 >= DEQUE_SIZE_MIN)
+    {
+        size_t newcap = d->capacity >> 1;
+
+        // BUG: No OOM checking.
+        move_ring(d, malloc(newcap * sizeof(Value)), newcap);
+    }
+}
+
+size_t length(Deque* d)
+{
+    return d->length;
+}
+
+// `d' MUST be allocated in the parent function with a stub like Array's,
+// where the header is offsetof(Deque, static_elems) bytes and
+// static_capacity is set up instead.
+void init(Deque* d)
+{
+    d->dynamic_elems = NULL;
+    d->head = 0;
+    d->length = 0;
+    d->capacity = d->static_capacity;
+    // d->static_capacity was set in assembly.
+    // d->static_elems can be left undefined.
+}
+
+void destroy(Deque* d)
+{
+    Value* elems = storage(d);
+
+    size_t first = d->capacity - d->head;
+    if(first > d->length)
+        first = d->length;
+
+    destroy_elems(elems + d->head, first);
+    destroy_elems(elems, d->length - first);
+
+    if(d->dynamic_elems)
+        free(d->dynamic_elems);
+}
+
+void pcopy(Deque* d)
+{
+    if(d->dynamic_elems)
+    {
+        // BUG: No OOM checking.
+        size_t dynamic_bytes = d->capacity * sizeof(Value);
+        Value* new_mem = malloc(dynamic_bytes);
+        memcpy(new_mem, d->dynamic_elems, dynamic_bytes);
+        d->dynamic_elems = new_mem;
+    }
+
+    Value* elems = storage(d);
+    for(size_t i = 0; i < d->length; ++i)
+        pcopy(&elems[wrap(d, d->head + i)]);
+}
+
+void push_back(Deque* d, const Value* v)
+{
+    if(d->length == d->capacity)
+        grow(d);
+
+    storage(d)[wrap(d, d->head + d->length)] = *v;
+    ++d->length;
+}
+
+void push_front(Deque* d, const Value* v)
+{
+    if(d->length == d->capacity)
+        grow(d);
+
+    d->head = d->head == 0 ? d->capacity - 1 : d->head - 1;
+    storage(d)[d->head] = *v;
+    ++d->length;
+}
+
+// Note: Like array.c's removal functions, the pops do not call pcopy or any
+// destructors on the returned element.
+
+Value pop_back(Deque* d)
+{
+    assert(d->length > 0);
+
+    --d->length;
+    Value ret = storage(d)[wrap(d, d->head + d->length)];
+
+    maybe_shrink(d);
+    return ret;
+}
+
+Value pop_front(Deque* d)
+{
+    assert(d->length > 0);
+
+    Value ret = storage(d)[d->head];
+    d->head = wrap(d, d->head + 1);
+    --d->length;
+
+    maybe_shrink(d);
+    return ret;
+}
+
+// Returns a pointer to the value `i' elements from the front.
+// This entire function should be inlined by the compiler.
+Value* index(Deque* d, size_t i)
+{
+    assert(i < d->length);
+
+    return &storage(d)[wrap(d, d->head + i)];
+}
+
+void foreach(Deque* d, void (*iter)(Value*, void*), void* aux)
+{
+    Value* elems = storage(d);
+
+    // Two contiguous runs, rather than a wrap() per element.
+    size_t first = d->capacity - d->head;
+    if(first > d->length)
+        first = d->length;
+
+    for(size_t i = 0; i < first; ++i)
+        iter(elems + d->head + i, aux);
+
+    for(size_t i = 0; i < d->length - first; ++i)
+        iter(elems + i, aux);
+}
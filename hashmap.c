@@ -0,0 +1,387 @@
+// hashmap.c: Defines NewLang's hash map type.
+//
+// A HashMap is an open-addressing table in the style of SwissTable. Next to
+// the slots, it keeps one control byte per slot:
+//
+//   EMPTY     (0x80) - never used.
+//   DELETED   (0xFE) - used, then erased. Probes must continue past it.
+//   0x00-0x7F        - full. The low 7 bits of the slot's hash (its `h2').
+//
+// Lookups load the control bytes a group (16) at a time, and with one SIMD
+// compare find every slot in the group whose h2 matches. Only those slots
+// (usually none or one) have their keys compared, and since the control bytes
+// are much denser than the slots, most misses never touch a slot at all.
+//
+// Like the static half of array.c, a map starts out with inline storage:
+// HASHMAP_STATIC_CAPACITY slots and their control bytes live inside the
+// HashMap itself, so small maps (HTTP header maps, most routing tables)
+// never allocate. Past that, the table moves to the heap and doubles as it
+// fills. The inline table is a single group, so any probe sees all of it.
+//
+// This file assumes that the following have been defined for `Key':
+//   uint64_t hash(const Key*)
+//   bool equals(const Key*, const Key*)
+// The table uses both the low 7 bits and the high bits of the hash, so it
+// must be well mixed. An identity hash on integers is not good enough.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The number of control bytes examined at once. This is the width of an SSE2
+// register, and MUST be a power of two.
+#define GROUP_WIDTH             16
+
+// The capacity of the inline table. This MUST equal GROUP_WIDTH, since the
+// single-group shortcuts below depend on it.
+#define HASHMAP_STATIC_CAPACITY GROUP_WIDTH
+
+// Like VALUE_TRIVIALLY_DESTRUCTIBLE (see array.c), but for destroy(Key*).
+#ifndef KEY_TRIVIALLY_DESTRUCTIBLE
+#define KEY_TRIVIALLY_DESTRUCTIBLE 0
+#endif
+
+#define CTRL_EMPTY              ((int8_t)0x80)
+#define CTRL_DELETED            ((int8_t)0xFE)
+
+struct Slot
+{
+    Key key;
+    Value val;
+};
+
+struct HashMap
+{
+    size_t size;
+    size_t capacity;
+    // The number of inserts that may happen before the table is over its
+    // maximum load factor of 7/8. Tombstones count against it.
+    size_t growth_left;
+
+    // Both NULL while the table lives in the inline arrays below. As in
+    // deque.c, we can't point them at the inline arrays, since the compiler
+    // is free to copy the struct around.
+    int8_t* dynamic_ctrl;
+    Slot* dynamic_slots;
+
+    // The control bytes are followed by a copy of the first GROUP_WIDTH of
+    // them, so that a group can be loaded starting at any slot without
+    // wrapping around.
+    int8_t static_ctrl[HASHMAP_STATIC_CAPACITY + GROUP_WIDTH];
+    Slot static_slots[HASHMAP_STATIC_CAPACITY];
+};
+
+static int8_t* ctrl(HashMap* m)
+{
+    return m->dynamic_ctrl ? m->dynamic_ctrl : m->static_ctrl;
+}
+
+static Slot* slots(HashMap* m)
+{
+    return m->dynamic_slots ? m->dynamic_slots : m->static_slots;
+}
+
+static size_t h1(uint64_t h) { return (size_t)(h >> 7); }
+static int8_t h2(uint64_t h) { return (int8_t)(h & 0x7F); }
+
+static bool is_full(int8_t c) { return c >= 0; }
+
+static size_t max_load(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+// A bitmask with bit `i' set for each matching control byte in the group.
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+
+static GroupMask match(const int8_t* group, int8_t c)
+{
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+}
+
+// EMPTY and DELETED are the only control bytes with their sign bit set.
+static GroupMask match_empty_or_deleted(const int8_t* group)
+{
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(g);
+}
+
+#else
+
+static GroupMask match(const int8_t* group, int8_t c)
+{
+    GroupMask mask = 0;
+    for(size_t i = 0; i < GROUP_WIDTH; ++i)
+        mask |= (GroupMask)(group[i] == c) << i;
+    return mask;
+}
+
+static GroupMask match_empty_or_deleted(const int8_t* group)
+{
+    GroupMask mask = 0;
+    for(size_t i = 0; i < GROUP_WIDTH; ++i)
+        mask |= (GroupMask)(group[i] < 0) << i;
+    return mask;
+}
+
+#endif
+
+static size_t lowest_bit(GroupMask mask)
+{
+    return (size_t)__builtin_ctz(mask);
+}
+
+// Sets a control byte, keeping the mirrored copy after the table in sync.
+static void set_ctrl(HashMap* m, size_t i, int8_t c)
+{
+    int8_t* cb = ctrl(m);
+
+    cb[i] = c;
+    if(i < GROUP_WIDTH)
+        cb[m->capacity + i] = c;
+}
+
+// Probes group by group. Each step jumps one group further than the last,
+// which visits every group exactly once when the capacity is a power of two.
+// Returns the slot holding `key', or NULL.
+static Slot* find_slot(HashMap* m, const Key* key, uint64_t h)
+{
+    int8_t* cb = ctrl(m);
+    Slot* sl = slots(m);
+    size_t mask = m->capacity - 1;
+
+    size_t pos = h1(h) & mask;
+    for(size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH)
+    {
+        for(GroupMask hits = match(cb + pos, h2(h)); hits; hits &= hits - 1)
+        {
+            Slot* s = &sl[(pos + lowest_bit(hits)) & mask];
+            if(equals(&s->key, key))
+                return s;
+        }
+
+        // An EMPTY anywhere in the group means the key would have been
+        // placed here, had it been inserted.
+        if(match(cb + pos, CTRL_EMPTY))
+            return NULL;
+
+        pos = (pos + step) & mask;
+    }
+}
+
+// Returns the index of the first EMPTY or DELETED slot on the probe sequence
+// for `h'. The load factor guarantees there is one.
+static size_t find_free(HashMap* m, uint64_t h)
+{
+    int8_t* cb = ctrl(m);
+    size_t mask = m->capacity - 1;
+
+    size_t pos = h1(h) & mask;
+    for(size_t step = GROUP_WIDTH; ; step += GROUP_WIDTH)
+    {
+        GroupMask free_slots = match_empty_or_deleted(cb + pos);
+        if(free_slots)
+            return (pos + lowest_bit(free_slots)) & mask;
+
+        pos = (pos + step) & mask;
+    }
+}
+
+// Moves every element into a fresh heap table of `newcap' slots. This also
+// drops all tombstones.
+static void resize(HashMap* m, size_t newcap)
+{
+    int8_t* old_ctrl = ctrl(m);
+    Slot* old_slots = slots(m);
+    size_t old_capacity = m->capacity;
+    bool was_dynamic = m->dynamic_ctrl != NULL;
+
+    // BUG: No OOM checking.
+    m->dynamic_ctrl = malloc(newcap + GROUP_WIDTH);
+    m->dynamic_slots = malloc(newcap * sizeof(Slot));
+    memset(m->dynamic_ctrl, CTRL_EMPTY, newcap + GROUP_WIDTH);
+
+    m->capacity = newcap;
+    m->growth_left = max_load(newcap) - m->size;
+
+    for(size_t i = 0; i < old_capacity; ++i)
+    {
+        if(!is_full(old_ctrl[i]))
+            continue;
+
+        uint64_t h = hash(&old_slots[i].key);
+        size_t j = find_free(m, h);
+
+        set_ctrl(m, j, h2(h));
+        m->dynamic_slots[j] = old_slots[i];
+    }
+
+    if(was_dynamic)
+    {
+        free(old_ctrl);
+        free(old_slots);
+    }
+}
+
+size_t length(HashMap* m)
+{
+    return m->size;
+}
+
+void init(HashMap* m)
+{
+    m->size = 0;
+    m->capacity = HASHMAP_STATIC_CAPACITY;
+    m->growth_left = max_load(HASHMAP_STATIC_CAPACITY);
+
+    m->dynamic_ctrl = NULL;
+    m->dynamic_slots = NULL;
+
+    memset(m->static_ctrl, CTRL_EMPTY, sizeof(m->static_ctrl));
+    // m->static_slots can be left undefined.
+}
+
+void destroy(HashMap* m)
+{
+    // Skip the scan of every control byte when it would destroy nothing.
+#if !VALUE_TRIVIALLY_DESTRUCTIBLE || !KEY_TRIVIALLY_DESTRUCTIBLE
+    int8_t* cb = ctrl(m);
+    Slot* sl = slots(m);
+    for(size_t i = 0; i < m->capacity; ++i)
+    {
+        if(is_full(cb[i]))
+        {
+            destroy(&sl[i].key);
+            destroy(&sl[i].val);
+        }
+    }
+#endif
+
+    if(m->dynamic_ctrl)
+    {
+        free(m->dynamic_ctrl);
+        free(m->dynamic_slots);
+    }
+}
+
+void pcopy(HashMap* m)
+{
+    if(m->dynamic_ctrl)
+    {
+        // BUG: No OOM checking.
+        int8_t* new_ctrl = malloc(m->capacity + GROUP_WIDTH);
+        Slot* new_slots = malloc(m->capacity * sizeof(Slot));
+        memcpy(new_ctrl, m->dynamic_ctrl, m->capacity + GROUP_WIDTH);
+        memcpy(new_slots, m->dynamic_slots, m->capacity * sizeof(Slot));
+        m->dynamic_ctrl = new_ctrl;
+        m->dynamic_slots = new_slots;
+    }
+
+    int8_t* cb = ctrl(m);
+    Slot* sl = slots(m);
+    for(size_t i = 0; i < m->capacity; ++i)
+    {
+        if(is_full(cb[i]))
+        {
+            pcopy(&sl[i].key);
+            pcopy(&sl[i].val);
+        }
+    }
+}
+
+// Returns a pointer to the value stored under `key', or NULL if there is
+// none. The pointer is invalidated by the next insert.
+Value* find(HashMap* m, const Key* key)
+{
+    Slot* s = find_slot(m, key, hash(key));
+    return s ? &s->val : NULL;
+}
+
+// Maps `key' to `v'. Returns true if the key was not in the map before, and
+// false if an existing value was overwritten.
+bool insert(HashMap* m, const Key* key, const Value* v)
+{
+    uint64_t h = hash(key);
+
+    Slot* s = find_slot(m, key, h);
+    if(s)
+    {
+        s->val = *v;
+        return false;
+    }
+
+    if(m->growth_left == 0)
+    {
+        // If most of the used slots are tombstones, cleaning them out is
+        // enough. Otherwise, double.
+        if(m->dynamic_ctrl && m->size <= max_load(m->capacity) / 2)
+            resize(m, m->capacity);
+        else
+            resize(m, m->capacity * 2);
+    }
+
+    size_t i = find_free(m, h);
+
+    // Reusing a tombstone doesn't change the load.
+    if(ctrl(m)[i] == CTRL_EMPTY)
+        --m->growth_left;
+
+    set_ctrl(m, i, h2(h));
+    slots(m)[i].key = *key;
+    slots(m)[i].val = *v;
+    ++m->size;
+
+    return true;
+}
+
+// Removes `key' from the map. Returns true if it was present. Like array.c's
+// removal functions, this does not run any destructors.
+bool erase(HashMap* m, const Key* key)
+{
+    Slot* s = find_slot(m, key, hash(key));
+    if(s == NULL)
+        return false;
+
+    size_t i = (size_t)(s - slots(m));
+
+    // In a single-group table, every probe sees every slot, so no probe can
+    // depend on this slot staying non-EMPTY.
+    if(m->capacity == GROUP_WIDTH)
+    {
+        set_ctrl(m, i, CTRL_EMPTY);
+        ++m->growth_left;
+    }
+    else
+    {
+        set_ctrl(m, i, CTRL_DELETED);
+    }
+
+    --m->size;
+    return true;
+}
+
+// Iterates in slot order, which is unrelated to insertion order.
+void foreach(HashMap* m, void (*iter)(const Key*, Value*, void*), void* aux)
+{
+    int8_t* cb = ctrl(m);
+    Slot* sl = slots(m);
+
+    // Skip a whole group at a time where possible.
+    for(size_t pos = 0; pos < m->capacity; pos += GROUP_WIDTH)
+    {
+        GroupMask used = ~match_empty_or_deleted(cb + pos)
+                       & ((1u << GROUP_WIDTH) - 1);
+
+        for(; used; used &= used - 1)
+        {
+            Slot* s = &sl[pos + lowest_bit(used)];
+            iter(&s->key, &s->val, aux);
+        }
+    }
+}
@@ -0,0 +1,296 @@
+// hashmap_bench.c: Benchmarks HashMap against a chained hash table.
+//
+// The chained table is the textbook one, like C++'s std::unordered_map: an
+// array of buckets, each the head of a linked list of heap-allocated nodes,
+// doubling once there is one entry per bucket. A lookup there costs a cache
+// miss for the bucket and another for every node it walks, while a HashMap
+// lookup reads one group of control bytes and, usually, one slot.
+//
+// Each map size is filled with random keys, then probed with keys which are
+// all present (hits) and keys which are all absent (misses). Hits are probed
+// in a different order than they were inserted. The smallest size fits in
+// HashMap's inline table, like an HTTP header map; the largest is well out
+// of cache, like a big routing table.
+//
+// Build this together with hashmap.c, with Key and Value both uint64_t, in a
+// release or fast build (see "Compiler Options" in the README). It defines
+// the hash() and equals() which hashmap.c expects.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Roughly how many operations each measurement runs. Small maps are rebuilt
+// and probed over and over until they reach it.
+#define BENCH_OPS           (1 << 24)
+
+// The number of buckets a chained table starts with. This MUST be a power of
+// two.
+#define CHAINED_SIZE_MIN    16
+
+static const size_t BENCH_SIZES[] = { 8, 1 << 10, 1 << 20 };
+
+// Results are summed into here, so the compiler can't drop the lookups.
+static volatile uint64_t sink;
+
+struct ChainNode
+{
+    Key key;
+    Value val;
+    ChainNode* next;
+};
+
+struct ChainedMap
+{
+    size_t size;
+    size_t bucket_count;
+    ChainNode** buckets;
+};
+
+// The finalizer of splitmix64. Every bit of the key affects every bit of the
+// hash, as hashmap.c requires.
+uint64_t hash(const Key* k)
+{
+    uint64_t x = *k;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+bool equals(const Key* a, const Key* b)
+{
+    return *a == *b;
+}
+
+// splitmix64 itself: the finalizer over a Weyl sequence.
+static uint64_t random_u64(uint64_t* state)
+{
+    *state += 0x9E3779B97F4A7C15ull;
+    return hash(state);
+}
+
+static void shuffle(Key* keys, size_t n, uint64_t* state)
+{
+    for(size_t i = n; i > 1; --i)
+    {
+        size_t j = (size_t)(random_u64(state) % i);
+        Key tmp = keys[i - 1];
+        keys[i - 1] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void report(const char* map, const char* op, size_t n, double seconds,
+                   size_t ops)
+{
+    printf("%-8s %-7s n=%-8zu %8.2f ns/op\n", map, op, n,
+           seconds * 1e9 / (double)ops);
+}
+
+void init(ChainedMap* m)
+{
+    m->size = 0;
+    m->bucket_count = CHAINED_SIZE_MIN;
+
+    // BUG: No OOM checking.
+    m->buckets = calloc(m->bucket_count, sizeof(ChainNode*));
+}
+
+void destroy(ChainedMap* m)
+{
+    for(size_t b = 0; b < m->bucket_count; ++b)
+    {
+        ChainNode* n = m->buckets[b];
+        while(n)
+        {
+            ChainNode* next = n->next;
+            free(n);
+            n = next;
+        }
+    }
+
+    free(m->buckets);
+}
+
+static void rehash(ChainedMap* m, size_t bucket_count)
+{
+    // BUG: No OOM checking.
+    ChainNode** buckets = calloc(bucket_count, sizeof(ChainNode*));
+
+    for(size_t b = 0; b < m->bucket_count; ++b)
+    {
+        ChainNode* n = m->buckets[b];
+        while(n)
+        {
+            ChainNode* next = n->next;
+            size_t to = hash(&n->key) & (bucket_count - 1);
+
+            n->next = buckets[to];
+            buckets[to] = n;
+            n = next;
+        }
+    }
+
+    free(m->buckets);
+    m->buckets = buckets;
+    m->bucket_count = bucket_count;
+}
+
+Value* find(ChainedMap* m, const Key* key)
+{
+    ChainNode* n = m->buckets[hash(key) & (m->bucket_count - 1)];
+
+    for(; n; n = n->next)
+        if(equals(&n->key, key))
+            return &n->val;
+
+    return NULL;
+}
+
+bool insert(ChainedMap* m, const Key* key, const Value* v)
+{
+    Value* old = find(m, key);
+    if(old)
+    {
+        *old = *v;
+        return false;
+    }
+
+    if(m->size == m->bucket_count)
+        rehash(m, m->bucket_count * 2);
+
+    size_t b = hash(key) & (m->bucket_count - 1);
+
+    // BUG: No OOM checking.
+    ChainNode* n = malloc(sizeof(ChainNode));
+    n->key = *key;
+    n->val = *v;
+    n->next = m->buckets[b];
+
+    m->buckets[b] = n;
+    ++m->size;
+    return true;
+}
+
+// Times inserting `keys', and then looking up `hits' and `misses', all `n'
+// long. Building the map includes init and destroy, since for small maps
+// (which HashMap never allocates for) those are much of the cost.
+static void run(HashMap* m, const char* name, const Key* keys,
+                const Key* hits, const Key* misses, size_t n)
+{
+    size_t reps = n < BENCH_OPS ? BENCH_OPS / n : 1;
+    uint64_t sum = 0;
+
+    double t = now();
+    for(size_t r = 0; r < reps; ++r)
+    {
+        init(m);
+        for(size_t i = 0; i < n; ++i)
+        {
+            Value v = i;
+            insert(m, &keys[i], &v);
+        }
+
+        // Keep the last one, to look things up in.
+        if(r + 1 < reps)
+            destroy(m);
+    }
+    report(name, "insert", n, now() - t, reps * n);
+
+    t = now();
+    for(size_t r = 0; r < reps; ++r)
+        for(size_t i = 0; i < n; ++i)
+            sum += *find(m, &hits[i]);
+    report(name, "hit", n, now() - t, reps * n);
+
+    t = now();
+    for(size_t r = 0; r < reps; ++r)
+        for(size_t i = 0; i < n; ++i)
+            sum += find(m, &misses[i]) != NULL;
+    report(name, "miss", n, now() - t, reps * n);
+
+    destroy(m);
+    sink += sum;
+}
+
+static void run(ChainedMap* m, const char* name, const Key* keys,
+                const Key* hits, const Key* misses, size_t n)
+{
+    size_t reps = n < BENCH_OPS ? BENCH_OPS / n : 1;
+    uint64_t sum = 0;
+
+    double t = now();
+    for(size_t r = 0; r < reps; ++r)
+    {
+        init(m);
+        for(size_t i = 0; i < n; ++i)
+        {
+            Value v = i;
+            insert(m, &keys[i], &v);
+        }
+
+        if(r + 1 < reps)
+            destroy(m);
+    }
+    report(name, "insert", n, now() - t, reps * n);
+
+    t = now();
+    for(size_t r = 0; r < reps; ++r)
+        for(size_t i = 0; i < n; ++i)
+            sum += *find(m, &hits[i]);
+    report(name, "hit", n, now() - t, reps * n);
+
+    t = now();
+    for(size_t r = 0; r < reps; ++r)
+        for(size_t i = 0; i < n; ++i)
+            sum += find(m, &misses[i]) != NULL;
+    report(name, "miss", n, now() - t, reps * n);
+
+    destroy(m);
+    sink += sum;
+}
+
+int main(void)
+{
+    for(size_t s = 0; s < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]); ++s)
+    {
+        size_t n = BENCH_SIZES[s];
+        uint64_t state = n;
+
+        // BUG: No OOM checking.
+        Key* keys = malloc(n * sizeof(Key));
+        Key* hits = malloc(n * sizeof(Key));
+        Key* misses = malloc(n * sizeof(Key));
+
+        // Keys inserted are even and keys probed for misses are odd, so the
+        // two never overlap.
+        for(size_t i = 0; i < n; ++i)
+        {
+            keys[i] = random_u64(&state) & ~(uint64_t)1;
+            misses[i] = random_u64(&state) | 1;
+        }
+
+        memcpy(hits, keys, n * sizeof(Key));
+        shuffle(hits, n, &state);
+
+        HashMap hm;
+        run(&hm, "HashMap", keys, hits, misses, n);
+
+        ChainedMap cm;
+        run(&cm, "chained", keys, hits, misses, n);
+
+        free(keys);
+        free(hits);
+        free(misses);
+    }
+
+    return 0;
+}
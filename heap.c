@@ -0,0 +1,182 @@
+// heap.c: Defines NewLang's priority queue type.
+//
+// A PriorityQueue is a 4-ary min-heap stored in an Array (see array.c). Each
+// node has four children rather than two, so the heap is half as deep, and
+// the four children sit next to each other, usually in one cache line: a
+// sift down does more comparisons per level, but takes half as many cache
+// misses to reach the bottom.
+//
+// Since the storage is an Array, the first elements live in its static half,
+// inline in the queue. A queue which never holds more than that never
+// allocates.
+//
+// decrease_key needs to know where an element is, and elements move every
+// time the heap is rearranged. If the caller needs that, it passes a `moved'
+// callback, which is told the new position of every element that moves.
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef bool (*Less)(const Value*, const Value*, void*);
+
+// Called with an element and its new position whenever it moves.
+typedef void (*Moved)(Value*, size_t, void*);
+
+struct PriorityQueue
+{
+    Less less;
+    Moved moved;
+    void* aux;
+
+    // MUST be last: its static half is allocated inline, after the queue.
+    Array elems;
+};
+
+static size_t parent(size_t i) { return (i - 1) / 4; }
+static size_t first_child(size_t i) { return 4 * i + 1; }
+
+static Value* at(PriorityQueue* q, size_t i)
+{
+    return index_unchecked(&q->elems, i);
+}
+
+// Stores `v' at position `i', and tells the caller about it.
+static void place(PriorityQueue* q, size_t i, const Value* v)
+{
+    *at(q, i) = *v;
+
+    if(q->moved)
+        q->moved(at(q, i), i, q->aux);
+}
+
+// Moves `v' from position `i' up towards the root until its parent is no
+// greater than it. The elements it passes are shifted down into the hole,
+// rather than swapped, which halves the number of writes.
+static void sift_up(PriorityQueue* q, size_t i, Value v)
+{
+    while(i > 0)
+    {
+        size_t p = parent(i);
+        if(!q->less(&v, at(q, p), q->aux))
+            break;
+
+        place(q, i, at(q, p));
+        i = p;
+    }
+
+    place(q, i, &v);
+}
+
+static void sift_down(PriorityQueue* q, size_t i, Value v)
+{
+    size_t n = length(&q->elems);
+
+    for(;;)
+    {
+        size_t c = first_child(i);
+        if(c >= n)
+            break;
+
+        // Find the least of up to four children.
+        size_t end = c + 4 < n ? c + 4 : n;
+        size_t least = c;
+        for(size_t k = c + 1; k < end; ++k)
+            if(q->less(at(q, k), at(q, least), q->aux))
+                least = k;
+
+        if(!q->less(at(q, least), &v, q->aux))
+            break;
+
+        place(q, i, at(q, least));
+        i = least;
+    }
+
+    place(q, i, &v);
+}
+
+size_t length(PriorityQueue* q)
+{
+    return length(&q->elems);
+}
+
+// `q' MUST be allocated in the parent function with the same stub as an
+// Array, where the header is offsetof(PriorityQueue, elems.static_elems)
+// bytes and elems.static_capacity is set up instead. `moved' may be NULL.
+void init(PriorityQueue* q, Less less, Moved moved, void* aux)
+{
+    q->less = less;
+    q->moved = moved;
+    q->aux = aux;
+
+    init(&q->elems);
+}
+
+void destroy(PriorityQueue* q)
+{
+    destroy(&q->elems);
+}
+
+void pcopy(PriorityQueue* q)
+{
+    pcopy(&q->elems);
+}
+
+void push(PriorityQueue* q, const Value* v)
+{
+    // Grow by one, then sift the new element up from the end.
+    append(&q->elems, v);
+    sift_up(q, length(&q->elems) - 1, *v);
+}
+
+// Returns a pointer to the least element. The pointer is invalidated by the
+// next push or pop.
+Value* top(PriorityQueue* q)
+{
+    assert(length(&q->elems) > 0);
+
+    return at(q, 0);
+}
+
+// Removes and returns the least element. Like array.c's removal functions,
+// this does not call pcopy or any destructors on it.
+Value pop(PriorityQueue* q)
+{
+    assert(length(&q->elems) > 0);
+
+    Value ret = *at(q, 0);
+    Value last = remove_last(&q->elems);
+
+    if(length(&q->elems) > 0)
+        sift_down(q, 0, last);
+
+    return ret;
+}
+
+// Replaces the element at position `i' with `v', which MUST be no greater
+// than it, and restores the heap.
+void decrease_key(PriorityQueue* q, size_t i, const Value* v)
+{
+    assert(i < length(&q->elems));
+    assert(!q->less(at(q, i), v, q->aux));
+
+    sift_up(q, i, *v);
+}
+
+// Removes and returns the element at position `i', wherever it is.
+Value remove_at(PriorityQueue* q, size_t i)
+{
+    assert(i < length(&q->elems));
+
+    Value ret = *at(q, i);
+    Value last = remove_last(&q->elems);
+
+    // The last element fills the hole, then moves whichever way it has to.
+    if(i < length(&q->elems))
+    {
+        if(i > 0 && q->less(&last, at(q, parent(i)), q->aux))
+            sift_up(q, i, last);
+        else
+            sift_down(q, i, last);
+    }
+
+    return ret;
+}
@@ -0,0 +1,329 @@
+// jagged.c: Defines NewLang's flattened array-of-arrays type.
+//
+// An Array of Arrays pays for every row twice: once for its 40-byte header,
+// and once for its own dynamic allocation. For something like an adjacency
+// list, with millions of short rows, that is millions of mallocs, and rows
+// scattered all over the heap.
+//
+// A Jagged array stores the same thing in compressed sparse row (CSR) form:
+// every row's elements back to back in one buffer, and an offsets array where
+// row r is elems[offsets[r], offsets[r + 1]). That is two allocations in
+// total, rows are adjacent in memory, and iterating every element is one
+// linear scan.
+//
+// The price is that only the last row can grow. Rows are built in order,
+// with push_row (or start_row, then append), which suits data that is built
+// once and then read many times.
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// The minimum capacity of the offsets and element buffers after their initial
+// allocation.
+#define JAGGED_SIZE_MIN         16
+
+// parallel_foreach_row only spreads across threads once there are at least
+// this many elements; below it, spawning costs more than it saves.
+#define JAGGED_PARALLEL_MIN     (1 << 14)
+
+#define JAGGED_THREADS_MAX      64
+
+struct Jagged
+{
+    size_t row_count;
+    size_t offsets_capacity;
+    // row_count + 1 entries; offsets[0] is always 0, and offsets[row_count]
+    // is the total number of elements.
+    size_t* offsets;
+
+    size_t elems_capacity;
+    Value* elems;
+};
+
+// A view of one row. It is invalidated by anything that grows the array.
+struct Row
+{
+    Value* elems;
+    size_t length;
+};
+
+static void reserve_offsets(Jagged* j, size_t n)
+{
+    if(n <= j->offsets_capacity)
+        return;
+
+    size_t newcap = j->offsets_capacity ? j->offsets_capacity : JAGGED_SIZE_MIN;
+    while(newcap < n)
+        newcap *= 2;
+
+    // BUG: No OOM checking.
+    j->offsets = realloc(j->offsets, newcap * sizeof(size_t));
+    j->offsets_capacity = newcap;
+}
+
+static void reserve_elems(Jagged* j, size_t n)
+{
+    if(n <= j->elems_capacity)
+        return;
+
+    size_t newcap = j->elems_capacity ? j->elems_capacity : JAGGED_SIZE_MIN;
+    while(newcap < n)
+        newcap *= 2;
+
+    // BUG: No OOM checking.
+    j->elems = realloc(j->elems, newcap * sizeof(Value));
+    j->elems_capacity = newcap;
+}
+
+// The number of rows.
+size_t length(Jagged* j)
+{
+    return j->row_count;
+}
+
+// The total number of elements, over every row.
+size_t elem_count(Jagged* j)
+{
+    return j->offsets[j->row_count];
+}
+
+void init(Jagged* j)
+{
+    j->row_count = 0;
+    j->offsets_capacity = 0;
+    j->offsets = NULL;
+
+    j->elems_capacity = 0;
+    j->elems = NULL;
+
+    reserve_offsets(j, 1);
+    j->offsets[0] = 0;
+}
+
+void destroy(Jagged* j)
+{
+    destroy_elems(j->elems, elem_count(j));
+
+    free(j->offsets);
+    if(j->elems)
+        free(j->elems);
+}
+
+void pcopy(Jagged* j)
+{
+    // BUG: No OOM checking.
+    size_t* offsets = malloc(j->offsets_capacity * sizeof(size_t));
+    memcpy(offsets, j->offsets, (j->row_count + 1) * sizeof(size_t));
+    j->offsets = offsets;
+
+    if(j->elems)
+    {
+        size_t n = elem_count(j);
+        Value* elems = malloc(j->elems_capacity * sizeof(Value));
+        memcpy(elems, j->elems, n * sizeof(Value));
+        j->elems = elems;
+
+        for(size_t i = 0; i < n; ++i)
+            pcopy(&j->elems[i]);
+    }
+}
+
+// Reserves room for `rows' rows holding `elems' elements in total, so that
+// building the array up to that size allocates nothing more.
+void reserve(Jagged* j, size_t rows, size_t elems)
+{
+    reserve_offsets(j, rows + 1);
+    reserve_elems(j, elems);
+}
+
+// Starts a new, empty row at the end.
+void start_row(Jagged* j)
+{
+    reserve_offsets(j, j->row_count + 2);
+
+    j->offsets[j->row_count + 1] = j->offsets[j->row_count];
+    ++j->row_count;
+}
+
+// Appends `v' to the last row. There MUST be one.
+void append(Jagged* j, const Value* v)
+{
+    assert(j->row_count > 0);
+
+    size_t n = elem_count(j);
+
+    // FASTPATH
+    if(n == j->elems_capacity)
+        reserve_elems(j, n + 1);
+
+    j->elems[n] = *v;
+    ++j->offsets[j->row_count];
+}
+
+// Appends a row holding the `n' elements at `v'. Like Array's append, this
+// takes the elements as they are, without calling pcopy on them.
+void push_row(Jagged* j, const Value* v, size_t n)
+{
+    start_row(j);
+
+    size_t end = elem_count(j);
+    reserve_elems(j, end + n);
+
+    memcpy(j->elems + end, v, n * sizeof(Value));
+    j->offsets[j->row_count] = end + n;
+}
+
+// Appends a copy of every element of `a' as a new row. This is how an
+// existing Array of Arrays is flattened: push each inner array, then destroy
+// the outer one.
+void push_row(Jagged* j, Array* a)
+{
+    start_row(j);
+    reserve_elems(j, elem_count(j) + length(a));
+
+    size_t end = elem_count(j);
+    size_t n = length(a);
+    memcpy(j->elems + end, a->static_elems, a->static_length * sizeof(Value));
+    memcpy(j->elems + end + a->static_length, a->dynamic_elems,
+           a->dynamic_length * sizeof(Value));
+
+    for(size_t i = end; i < end + n; ++i)
+        pcopy(&j->elems[i]);
+
+    j->offsets[j->row_count] = end + n;
+}
+
+// Returns a view of row `r'.
+Row row(Jagged* j, size_t r)
+{
+    assert(r < j->row_count);
+
+    Row ret = { j->elems + j->offsets[r], j->offsets[r + 1] - j->offsets[r] };
+    return ret;
+}
+
+// Returns a pointer to element `i' of row `r'.
+Value* index(Jagged* j, size_t r, size_t i)
+{
+    assert(r < j->row_count);
+    assert(i < j->offsets[r + 1] - j->offsets[r]);
+
+    return &j->elems[j->offsets[r] + i];
+}
+
+// Calls `iter' on every element, in order. Since every row is stored back to
+// back, this is a single linear scan.
+void foreach(Jagged* j, void (*iter)(Value*, void*), void* aux)
+{
+    size_t n = elem_count(j);
+
+    for(size_t i = 0; i < n; ++i)
+        iter(j->elems + i, aux);
+}
+
+// Calls `iter' on every row, with its index.
+void foreach_row(Jagged* j, void (*iter)(size_t, Row, void*), void* aux)
+{
+    for(size_t r = 0; r < j->row_count; ++r)
+        iter(r, row(j, r), aux);
+}
+
+struct RowTask
+{
+    Jagged* j;
+    size_t lo;
+    size_t hi;
+    void (*iter)(size_t, Row, void*);
+    void* aux;
+};
+
+static void* row_task(void* p)
+{
+    RowTask* t = p;
+
+    for(size_t r = t->lo; r < t->hi; ++r)
+        t->iter(r, row(t->j, r), t->aux);
+    return NULL;
+}
+
+// Returns the first row which ends after element `e'.
+static size_t row_of(Jagged* j, size_t e)
+{
+    size_t lo = 0;
+    size_t hi = j->row_count;
+
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(j->offsets[mid + 1] <= e)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Like foreach_row, but spreads the rows across up to one thread per CPU.
+// `iter' is called concurrently, so it MUST be safe to, and rows are visited
+// in no particular order.
+//
+// Row lengths are usually skewed (a few hubs, many leaves), so rows are not
+// split evenly by count. Instead, each thread gets a contiguous range holding
+// roughly the same number of elements, found by binary searching the offsets.
+void parallel_foreach_row(Jagged* j, void (*iter)(size_t, Row, void*),
+                          void* aux)
+{
+    size_t n = elem_count(j);
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    size_t threads = cpus > 0 ? (size_t)cpus : 1;
+    if(threads > JAGGED_THREADS_MAX)
+        threads = JAGGED_THREADS_MAX;
+    if(threads > j->row_count)
+        threads = j->row_count;
+
+    if(n < JAGGED_PARALLEL_MIN || threads <= 1)
+    {
+        foreach_row(j, iter, aux);
+        return;
+    }
+
+    RowTask tasks[JAGGED_THREADS_MAX];
+    pthread_t handles[JAGGED_THREADS_MAX];
+
+    size_t lo = 0;
+    for(size_t t = 0; t < threads; ++t)
+    {
+        size_t hi = t + 1 == threads ? j->row_count
+                                     : row_of(j, n * (t + 1) / threads);
+        if(hi < lo)
+            hi = lo;
+
+        RowTask task = { j, lo, hi, iter, aux };
+        tasks[t] = task;
+        lo = hi;
+    }
+
+    // BUG: No checking for failure to spawn a thread.
+    for(size_t t = 1; t < threads; ++t)
+        pthread_create(&handles[t], NULL, row_task, &tasks[t]);
+
+    // The calling thread takes a share of the work, rather than idling.
+    row_task(&tasks[0]);
+
+    for(size_t t = 1; t < threads; ++t)
+        pthread_join(handles[t], NULL);
+}
+
+// Removes the last row, destroying its elements.
+void remove_last(Jagged* j)
+{
+    assert(j->row_count > 0);
+
+    size_t start = j->offsets[j->row_count - 1];
+    destroy_elems(j->elems + start, elem_count(j) - start);
+
+    --j->row_count;
+}
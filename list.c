@@ -0,0 +1,248 @@
+// list.c: Defines NewLang's singly linked list, List(T) from the README.
+//
+// Naively, every Node(T) of a List(T) is its own heap allocation, scattered
+// wherever malloc happened to find room, and walking the list is one cache
+// miss per element. Instead, each list carries its own node pool: nodes are
+// handed out from a SegmentedArray (see segmented_array.c) of Nodes, and
+// freed nodes go onto a free list threaded through their `next' fields, to be
+// handed out again before the pool grows.
+//
+// This keeps a list's nodes packed together in a few large blocks, and since
+// the pool is a SegmentedArray:
+//   - Its static half holds the first few nodes inline, so short lists never
+//     allocate.
+//   - Growing the pool never moves a node, so nodes may point at each other.
+//
+// By default, a link to a node in the pool's dynamic half is a plain pointer,
+// so a hop costs nothing extra. Nodes in the static half can't be pointed at,
+// though: they live inside the List itself, which the compiler is free to
+// copy around (see deque.c). A link to one of those is its index in the pool
+// instead. The two never collide, since the static half is far smaller than
+// the lowest address malloc can return, so telling them apart is one
+// compare.
+//
+// Compact mode: define LIST_COMPACT, and nodes will refer to each other by
+// their 32-bit index in the pool everywhere. This halves the link size on
+// 64-bit machines (and shrinks Node(T) for small T), at the cost of an
+// index() on every hop. A compact list can hold at most 2^32 - 1 nodes.
+//
+// Throughout this file, the pool's Value is Node.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef LIST_COMPACT
+typedef uint32_t NodeRef;
+#define NIL         UINT32_MAX
+#else
+// Either a pool index below nodes.static_capacity, or a Node*.
+typedef uintptr_t NodeRef;
+#define NIL         UINTPTR_MAX
+#endif
+
+struct Node
+{
+    T val;
+    NodeRef next;
+};
+
+struct List
+{
+    NodeRef head;
+    NodeRef free;
+    size_t length;
+
+    // MUST be last: its static half is allocated inline, after the list.
+    SegmentedArray nodes;
+};
+
+static Node* node(List* l, NodeRef r)
+{
+#ifdef LIST_COMPACT
+    return index(&l->nodes, r);
+#else
+    if(r < l->nodes.static_capacity)
+        return &l->nodes.static_elems[r];
+
+    return (Node*)r;
+#endif
+}
+
+// Hands out a node, preferring one off the free list. Its fields are left
+// undefined.
+static NodeRef alloc_node(List* l)
+{
+    if(l->free != NIL)
+    {
+        NodeRef r = l->free;
+        l->free = node(l, r)->next;
+        return r;
+    }
+
+    Node blank;
+    append(&l->nodes, &blank);
+
+#ifdef LIST_COMPACT
+    assert(length(&l->nodes) - 1 < NIL);
+    return (NodeRef)(length(&l->nodes) - 1);
+#else
+    size_t i = length(&l->nodes) - 1;
+    if(i < l->nodes.static_capacity)
+        return (NodeRef)i;
+
+    return (NodeRef)index(&l->nodes, i);
+#endif
+}
+
+static void free_node(List* l, NodeRef r)
+{
+    node(l, r)->next = l->free;
+    l->free = r;
+}
+
+size_t length(List* l)
+{
+    return l->length;
+}
+
+// `l' MUST be allocated in the parent function with the same stub as an
+// Array, where the header is offsetof(List, nodes.static_elems) bytes and
+// nodes.static_capacity is set up instead.
+void init(List* l)
+{
+    l->head = NIL;
+    l->free = NIL;
+    l->length = 0;
+
+    init(&l->nodes);
+}
+
+// Only the live nodes hold values, so they are destroyed by walking the list
+// rather than the pool. The pool's memory is then released all at once; Node
+// itself has the empty default destructor.
+//
+// Here VALUE_TRIVIALLY_DESTRUCTIBLE (see array.c) describes T, since that's
+// what the list holds.
+void destroy(List* l)
+{
+#if !VALUE_TRIVIALLY_DESTRUCTIBLE
+    for(NodeRef r = l->head; r != NIL; r = node(l, r)->next)
+        destroy(&node(l, r)->val);
+#endif
+
+    destroy(&l->nodes);
+}
+
+// Rather than fixing up every link, the copy is rebuilt from scratch. This
+// also drops the free list, so the copy's nodes are in list order with no
+// holes.
+void pcopy(List* l)
+{
+    // The struct was copied bitwise, so the pool still refers to the
+    // original's blocks. Read everything out before letting go of them.
+    size_t n = l->length;
+
+    // BUG: No OOM checking.
+    T* vals = malloc(n * sizeof(T));
+
+    size_t i = 0;
+    for(NodeRef r = l->head; r != NIL; r = node(l, r)->next)
+        vals[i++] = node(l, r)->val;
+
+    // init() drops the shared blocks without freeing them.
+    init(l);
+
+    NodeRef* link = &l->head;
+    for(i = 0; i < n; ++i)
+    {
+        NodeRef r = alloc_node(l);
+        node(l, r)->val = vals[i];
+        pcopy(&node(l, r)->val);
+
+        *link = r;
+        link = &node(l, r)->next;
+    }
+    *link = NIL;
+    l->length = n;
+
+    free(vals);
+}
+
+// Returns the first node of the list, or NIL if it is empty.
+NodeRef first(List* l)
+{
+    return l->head;
+}
+
+// Returns the node after `r', or NIL at the end of the list.
+NodeRef next(List* l, NodeRef r)
+{
+    return node(l, r)->next;
+}
+
+// Returns a pointer to the value held by `r'. A NodeRef stays valid until its
+// node is removed, even if the List is moved, but this pointer does not: for
+// the first few nodes it points into the List itself.
+T* value(List* l, NodeRef r)
+{
+    return &node(l, r)->val;
+}
+
+NodeRef push_front(List* l, const T* v)
+{
+    NodeRef r = alloc_node(l);
+    node(l, r)->val = *v;
+    node(l, r)->next = l->head;
+
+    l->head = r;
+    ++l->length;
+    return r;
+}
+
+// Inserts `v' directly after `pos', and returns its node.
+NodeRef insert_after(List* l, NodeRef pos, const T* v)
+{
+    NodeRef r = alloc_node(l);
+    node(l, r)->val = *v;
+    node(l, r)->next = node(l, pos)->next;
+
+    node(l, pos)->next = r;
+    ++l->length;
+    return r;
+}
+
+// Note: As in array.c, the removal functions do not call pcopy or any
+// destructors on the returned element.
+
+T pop_front(List* l)
+{
+    assert(l->head != NIL);
+
+    NodeRef r = l->head;
+    T ret = node(l, r)->val;
+
+    l->head = node(l, r)->next;
+    free_node(l, r);
+    --l->length;
+    return ret;
+}
+
+// Removes the node directly after `pos', which MUST exist.
+T remove_after(List* l, NodeRef pos)
+{
+    NodeRef r = node(l, pos)->next;
+    assert(r != NIL);
+
+    T ret = node(l, r)->val;
+
+    node(l, pos)->next = node(l, r)->next;
+    free_node(l, r);
+    --l->length;
+    return ret;
+}
+
+void foreach(List* l, void (*iter)(T*, void*), void* aux)
+{
+    for(NodeRef r = l->head; r != NIL; r = node(l, r)->next)
+        iter(&node(l, r)->val, aux);
+}
@@ -0,0 +1,373 @@
+// ndarray.c: Defines NewLang's dense N-dimensional array type.
+//
+// An NdArray is a block of `float's (C's double; see "Built-in types" in the
+// README) viewed through a shape and a set of strides. Element (i, j, k) of a
+// 3-dimensional array lives at
+//
+//   data[i*strides[0] + j*strides[1] + k*strides[2]]
+//
+// so a matrix is one allocation and one multiply-add per index, instead of
+// an array of arrays with a bounds check and a pointer chase per row.
+//
+// Since the layout is only strides, transposing, slicing and reversing a
+// dimension are free: they produce views which share the original's data.
+// Kernels take any strides, but have fast paths for the common case of
+// contiguous row-major data, where the innermost loop is a plain unit-stride
+// loop over `restrict' pointers that the compiler turns into SIMD.
+//
+// The data is allocated the same way as the dynamic half of an Array in
+// aligned mode (see array.c), on a cache line boundary, so that rows of a
+// contiguous matrix whose width is a multiple of eight start aligned.
+#include <stddef.h>
+#include <stdbool.h>
+
+// The most dimensions an NdArray may have.
+#define NDARRAY_DIMS_MAX    8
+
+// The alignment of an NdArray's data.
+#define NDARRAY_ALIGNMENT   64
+
+// Tile sizes for the blocked kernels. A BLOCK_K x BLOCK_J panel of B (256 KiB
+// of doubles) should sit in L2, and a BLOCK_I x BLOCK_K panel of A (128 KiB)
+// alongside it, while one row of each streams through L1.
+#define BLOCK_I             64
+#define BLOCK_K             256
+#define BLOCK_J             128
+
+// The side of a square tile in transpose. A 32x32 tile of doubles is 8 KiB,
+// so both the source and destination tiles fit in L1 together.
+#define TRANSPOSE_TILE      32
+
+struct NdArray
+{
+    size_t ndim;
+    size_t shape[NDARRAY_DIMS_MAX];
+    // In elements, not bytes. May be negative or zero.
+    ptrdiff_t strides[NDARRAY_DIMS_MAX];
+
+    double* data;
+    // The allocation this array owns, or NULL if it is a view onto another
+    // array's data. A view must not outlive the array it was taken from.
+    double* owned;
+};
+
+static size_t element_count(const NdArray* a)
+{
+    size_t n = 1;
+    for(size_t d = 0; d < a->ndim; ++d)
+        n *= a->shape[d];
+    return n;
+}
+
+static double* alloc_data(size_t n)
+{
+    // aligned_alloc requires the size to be a multiple of the alignment.
+    size_t bytes = n * sizeof(double);
+    bytes = (bytes + NDARRAY_ALIGNMENT - 1) & ~(size_t)(NDARRAY_ALIGNMENT - 1);
+
+    // BUG: No OOM checking.
+    return aligned_alloc(NDARRAY_ALIGNMENT, bytes ? bytes : NDARRAY_ALIGNMENT);
+}
+
+// True if the array is laid out row-major with no gaps, so that its elements
+// can be treated as one flat run.
+static bool is_contiguous(const NdArray* a)
+{
+    ptrdiff_t expected = 1;
+    for(size_t d = a->ndim; d-- > 0; )
+    {
+        if(a->shape[d] != 1 && a->strides[d] != expected)
+            return false;
+        expected *= (ptrdiff_t)a->shape[d];
+    }
+    return true;
+}
+
+static bool same_shape(const NdArray* a, const NdArray* b)
+{
+    if(a->ndim != b->ndim)
+        return false;
+
+    for(size_t d = 0; d < a->ndim; ++d)
+        if(a->shape[d] != b->shape[d])
+            return false;
+
+    return true;
+}
+
+// Creates a zeroed, contiguous, row-major array.
+void init(NdArray* a, size_t ndim, const size_t* shape)
+{
+    assert(ndim <= NDARRAY_DIMS_MAX);
+
+    a->ndim = ndim;
+    memcpy(a->shape, shape, ndim * sizeof(size_t));
+
+    ptrdiff_t stride = 1;
+    for(size_t d = ndim; d-- > 0; )
+    {
+        a->strides[d] = stride;
+        stride *= (ptrdiff_t)shape[d];
+    }
+
+    size_t n = element_count(a);
+    a->owned = a->data = alloc_data(n);
+    memset(a->data, 0, n * sizeof(double));
+}
+
+void destroy(NdArray* a)
+{
+    free(a->owned);
+}
+
+// Returns a pointer to the element at `idx', which has one index per
+// dimension.
+double* index(NdArray* a, const size_t* idx)
+{
+    double* p = a->data;
+    for(size_t d = 0; d < a->ndim; ++d)
+    {
+        assert(idx[d] < a->shape[d]);
+        p += (ptrdiff_t)idx[d] * a->strides[d];
+    }
+    return p;
+}
+
+// Returns a view of `a' with dimensions `d0' and `d1' swapped. Nothing is
+// copied; use transpose() for a contiguous result.
+NdArray swap_axes(NdArray* a, size_t d0, size_t d1)
+{
+    assert(d0 < a->ndim && d1 < a->ndim);
+
+    NdArray v = *a;
+    v.owned = NULL;
+
+    v.shape[d0] = a->shape[d1];
+    v.shape[d1] = a->shape[d0];
+    v.strides[d0] = a->strides[d1];
+    v.strides[d1] = a->strides[d0];
+    return v;
+}
+
+// Returns a view of indices [from, to) along dimension `d'.
+NdArray slice(NdArray* a, size_t d, size_t from, size_t to)
+{
+    assert(d < a->ndim);
+    assert(from <= to && to <= a->shape[d]);
+
+    NdArray v = *a;
+    v.owned = NULL;
+
+    v.data += (ptrdiff_t)from * a->strides[d];
+    v.shape[d] = to - from;
+    return v;
+}
+
+// Makes `a' own a contiguous copy of whatever it was viewing.
+void pcopy(NdArray* a)
+{
+    NdArray src = *a;
+
+    init(a, src.ndim, src.shape);
+    copy(a, &src);
+}
+
+enum ElemOp { OP_COPY, OP_ADD, OP_MUL, OP_SCALE };
+
+// One innermost run of an elementwise kernel. The contiguous case gets its
+// own loop over restrict pointers, which is what lets it vectorize.
+static void run(ElemOp op, size_t n, double* out, ptrdiff_t so,
+                const double* x, ptrdiff_t sx, const double* y, ptrdiff_t sy,
+                double s)
+{
+    if(so == 1 && sx == 1 && (op == OP_COPY || op == OP_SCALE || sy == 1))
+    {
+        double* restrict o = out;
+        const double* restrict xs = x;
+        const double* restrict ys = y;
+
+        switch(op)
+        {
+        case OP_COPY:  for(size_t i = 0; i < n; ++i) o[i] = xs[i];         break;
+        case OP_ADD:   for(size_t i = 0; i < n; ++i) o[i] = xs[i] + ys[i]; break;
+        case OP_MUL:   for(size_t i = 0; i < n; ++i) o[i] = xs[i] * ys[i]; break;
+        case OP_SCALE: for(size_t i = 0; i < n; ++i) o[i] = xs[i] * s;     break;
+        }
+        return;
+    }
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        double xv = x[(ptrdiff_t)i * sx];
+        double v = xv;
+
+        switch(op)
+        {
+        case OP_COPY:  break;
+        case OP_ADD:   v = xv + y[(ptrdiff_t)i * sy]; break;
+        case OP_MUL:   v = xv * y[(ptrdiff_t)i * sy]; break;
+        case OP_SCALE: v = xv * s; break;
+        }
+
+        out[(ptrdiff_t)i * so] = v;
+    }
+}
+
+// Applies `op' to every element. The outer dimensions are walked with an
+// odometer; the innermost dimension is handed to run() in one go. If all the
+// operands are contiguous, the whole array is one run.
+static void elementwise(ElemOp op, NdArray* out, const NdArray* x,
+                        const NdArray* y, double s)
+{
+    assert(same_shape(out, x));
+    assert(y == NULL || same_shape(out, y));
+
+    if(is_contiguous(out) && is_contiguous(x) && (y == NULL || is_contiguous(y)))
+    {
+        run(op, element_count(out), out->data, 1, x->data, 1,
+            y ? y->data : NULL, 1, s);
+        return;
+    }
+
+    size_t last = out->ndim - 1;
+    size_t idx[NDARRAY_DIMS_MAX] = { 0 };
+
+    if(element_count(out) == 0)
+        return;
+
+    for(;;)
+    {
+        ptrdiff_t oo = 0, ox = 0, oy = 0;
+        for(size_t d = 0; d < last; ++d)
+        {
+            oo += (ptrdiff_t)idx[d] * out->strides[d];
+            ox += (ptrdiff_t)idx[d] * x->strides[d];
+            oy += y ? (ptrdiff_t)idx[d] * y->strides[d] : 0;
+        }
+
+        run(op, out->shape[last], out->data + oo, out->strides[last],
+            x->data + ox, x->strides[last],
+            y ? y->data + oy : NULL, y ? y->strides[last] : 0, s);
+
+        // Advance the odometer over every dimension but the last.
+        size_t d = last;
+        while(d-- > 0)
+        {
+            if(++idx[d] < out->shape[d])
+                break;
+            idx[d] = 0;
+        }
+        if(d == (size_t)-1)
+            return;
+    }
+}
+
+// `out' = `x'. The two may have different strides (but not overlap).
+void copy(NdArray* out, const NdArray* x) { elementwise(OP_COPY, out, x, NULL, 0); }
+
+// `out' = `x' + `y', elementwise.
+void add(NdArray* out, const NdArray* x, const NdArray* y) { elementwise(OP_ADD, out, x, y, 0); }
+
+// `out' = `x' * `y', elementwise.
+void mul(NdArray* out, const NdArray* x, const NdArray* y) { elementwise(OP_MUL, out, x, y, 0); }
+
+// `out' = `x' * `s'.
+void scale(NdArray* out, const NdArray* x, double s) { elementwise(OP_SCALE, out, x, NULL, s); }
+
+// `out' = the transpose of the matrix `x', materialized. Copying a matrix
+// into its transpose naively reads along rows and writes along columns, and
+// every write misses. Doing it a tile at a time keeps both the rows being
+// read and the columns being written in L1.
+void transpose(NdArray* out, const NdArray* x)
+{
+    assert(x->ndim == 2 && out->ndim == 2);
+    assert(out->shape[0] == x->shape[1] && out->shape[1] == x->shape[0]);
+
+    size_t rows = x->shape[0];
+    size_t cols = x->shape[1];
+
+    for(size_t i0 = 0; i0 < rows; i0 += TRANSPOSE_TILE)
+    for(size_t j0 = 0; j0 < cols; j0 += TRANSPOSE_TILE)
+    {
+        size_t i1 = i0 + TRANSPOSE_TILE < rows ? i0 + TRANSPOSE_TILE : rows;
+        size_t j1 = j0 + TRANSPOSE_TILE < cols ? j0 + TRANSPOSE_TILE : cols;
+
+        for(size_t i = i0; i < i1; ++i)
+            for(size_t j = j0; j < j1; ++j)
+                out->data[(ptrdiff_t)j * out->strides[0] + (ptrdiff_t)i * out->strides[1]]
+                    = x->data[(ptrdiff_t)i * x->strides[0] + (ptrdiff_t)j * x->strides[1]];
+    }
+}
+
+// Multiplies one BLOCK_I x BLOCK_K panel of A by one BLOCK_K x BLOCK_J panel
+// of B, into C. The loops run i, k, j: the innermost loop walks a row of B
+// and a row of C with unit stride, broadcasting one element of A, which is
+// exactly a vector FMA.
+static void matmul_block(double* restrict c, ptrdiff_t ldc,
+                         const double* restrict a, ptrdiff_t lda,
+                         const double* restrict b, ptrdiff_t ldb,
+                         size_t ni, size_t nk, size_t nj)
+{
+    for(size_t i = 0; i < ni; ++i)
+    {
+        double* restrict crow = c + (ptrdiff_t)i * ldc;
+
+        for(size_t k = 0; k < nk; ++k)
+        {
+            double aik = a[(ptrdiff_t)i * lda + (ptrdiff_t)k];
+            const double* restrict brow = b + (ptrdiff_t)k * ldb;
+
+            for(size_t j = 0; j < nj; ++j)
+                crow[j] += aik * brow[j];
+        }
+    }
+}
+
+// `c' = `a' x `b', for matrices. `c' MUST NOT alias either input.
+//
+// The product is computed a panel at a time, so that each panel of `b' is
+// loaded into cache once and then reused for BLOCK_I rows of `a', rather than
+// streamed from memory once per row. Inputs whose rows aren't unit-stride
+// (views from swap_axes, for instance) are copied into contiguous form first,
+// since the kernel depends on it.
+void matmul(NdArray* c, NdArray* a, NdArray* b)
+{
+    assert(a->ndim == 2 && b->ndim == 2 && c->ndim == 2);
+    assert(a->shape[1] == b->shape[0]);
+    assert(c->shape[0] == a->shape[0] && c->shape[1] == b->shape[1]);
+    assert(c->strides[1] == 1);
+
+    NdArray ca = *a;
+    NdArray cb = *b;
+    if(a->strides[1] != 1) pcopy(&ca);
+    else                   ca.owned = NULL;
+    if(b->strides[1] != 1) pcopy(&cb);
+    else                   cb.owned = NULL;
+
+    size_t m = a->shape[0];
+    size_t kk = a->shape[1];
+    size_t n = b->shape[1];
+
+    for(size_t i = 0; i < m; ++i)
+        memset(c->data + (ptrdiff_t)i * c->strides[0], 0, n * sizeof(double));
+
+    for(size_t k0 = 0; k0 < kk; k0 += BLOCK_K)
+    for(size_t j0 = 0; j0 < n; j0 += BLOCK_J)
+    for(size_t i0 = 0; i0 < m; i0 += BLOCK_I)
+    {
+        size_t nk = k0 + BLOCK_K < kk ? BLOCK_K : kk - k0;
+        size_t nj = j0 + BLOCK_J < n ? BLOCK_J : n - j0;
+        size_t ni = i0 + BLOCK_I < m ? BLOCK_I : m - i0;
+
+        matmul_block(c->data + (ptrdiff_t)i0 * c->strides[0] + (ptrdiff_t)j0,
+                     c->strides[0],
+                     ca.data + (ptrdiff_t)i0 * ca.strides[0] + (ptrdiff_t)k0,
+                     ca.strides[0],
+                     cb.data + (ptrdiff_t)k0 * cb.strides[0] + (ptrdiff_t)j0,
+                     cb.strides[0],
+                     ni, nk, nj);
+    }
+
+    destroy(&ca);
+    destroy(&cb);
+}
@@ -0,0 +1,311 @@
+// packed_array.c: Defines NewLang's compressed integer array type.
+//
+// A PackedArray holds unsigned integers (uint8 through uint64, all widened to
+// 64 bits here) in a fraction of the space of a plain Array, by splitting
+// them into blocks of PACKED_BLOCK_SIZE and bit-packing each block at the
+// narrowest width that fits it:
+//
+//   PACKED_FOR   - Frame of reference. Each block stores its minimum, and
+//                  every element as its distance from that minimum. Good for
+//                  any column whose values sit close together.
+//   PACKED_DELTA - Delta. Each block stores its first element, and every
+//                  element as its distance from the one before. Good for
+//                  sorted columns like id lists, whose gaps are much smaller
+//                  than the values themselves. The input MUST be sorted.
+//
+// Every block has a fixed-size header (its base, bit width, and where its
+// bits start), so finding an element's block is a division, and random access
+// needs no search. In FOR mode it is O(1) outright; in delta mode, it decodes
+// at most PACKED_BLOCK_SIZE deltas, which is still a constant.
+//
+// The most recent elements are held unpacked, in a tail block that works
+// like the static half of array.c: appends go there until it fills, and only
+// then is it packed into the payload.
+//
+// foreach decodes a whole block at a time into a buffer. The decoder is
+// branch-free, and with AVX2 it unpacks four elements per instruction.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// The number of elements in a block. This MUST be a multiple of 64, so that
+// every full block packs into a whole number of words.
+#define PACKED_BLOCK_SIZE   128
+
+// The minimum capacity of the block and payload buffers after their initial
+// allocation.
+#define PACKED_SIZE_MIN     16
+
+enum PackedMode { PACKED_FOR, PACKED_DELTA };
+
+struct PackedBlock
+{
+    uint64_t base;
+    // Where this block's bits start in the payload, in words.
+    size_t offset;
+    unsigned bits;
+};
+
+struct PackedArray
+{
+    PackedMode mode;
+
+    size_t block_count;
+    size_t block_capacity;
+    PackedBlock* blocks;
+
+    size_t payload_length;
+    size_t payload_capacity;
+    uint64_t* payload;
+
+    size_t tail_length;
+    uint64_t tail[PACKED_BLOCK_SIZE];
+};
+
+static uint64_t low_mask(unsigned bits)
+{
+    return bits == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+}
+
+// Reads the `bits'-wide field starting at bit `pos' of `w'. A field may
+// straddle two words; when it doesn't (shift == 0), the second word's
+// contribution is shifted out entirely rather than branched around. This is
+// why the payload always has padding at the end.
+static uint64_t extract(const uint64_t* w, size_t pos, uint64_t mask)
+{
+    size_t word = pos / 64;
+    unsigned shift = pos % 64;
+
+    uint64_t lo = w[word] >> shift;
+    uint64_t hi = (w[word + 1] << 1) << (63 - shift);
+    return (lo | hi) & mask;
+}
+
+static void reserve_payload(PackedArray* a, size_t words)
+{
+    if(words <= a->payload_capacity)
+        return;
+
+    size_t newcap = a->payload_capacity ? a->payload_capacity : PACKED_SIZE_MIN;
+    while(newcap < words)
+        newcap *= 2;
+
+    // BUG: No OOM checking.
+    a->payload = realloc(a->payload, newcap * sizeof(uint64_t));
+    a->payload_capacity = newcap;
+}
+
+// Packs the (full) tail into a new block.
+static void flush_tail(PackedArray* a)
+{
+    assert(a->tail_length == PACKED_BLOCK_SIZE);
+
+    uint64_t* v = a->tail;
+    uint64_t base = v[0];
+    uint64_t widest = 0;
+
+    // Turn the tail into offsets from the base, in place.
+    if(a->mode == PACKED_FOR)
+    {
+        for(size_t i = 1; i < PACKED_BLOCK_SIZE; ++i)
+            base = v[i] < base ? v[i] : base;
+        for(size_t i = 0; i < PACKED_BLOCK_SIZE; ++i)
+            v[i] -= base;
+    }
+    else
+    {
+        for(size_t i = PACKED_BLOCK_SIZE - 1; i > 0; --i)
+        {
+            assert(v[i] >= v[i - 1]);
+            v[i] -= v[i - 1];
+        }
+        v[0] = 0;
+    }
+
+    for(size_t i = 0; i < PACKED_BLOCK_SIZE; ++i)
+        widest |= v[i];
+
+    unsigned bits = widest ? 64 - (unsigned)__builtin_clzll(widest) : 0;
+    size_t words = PACKED_BLOCK_SIZE / 64 * bits;
+
+    if(a->block_count == a->block_capacity)
+    {
+        a->block_capacity = a->block_capacity ? a->block_capacity * 2
+                                              : PACKED_SIZE_MIN;
+
+        // BUG: No OOM checking.
+        a->blocks = realloc(a->blocks, a->block_capacity * sizeof(PackedBlock));
+    }
+
+    PackedBlock* b = &a->blocks[a->block_count++];
+    b->base = base;
+    b->offset = a->payload_length;
+    b->bits = bits;
+
+    // Padding for extract() to overrun into. A zero-width block reads two
+    // words past its start, and stores none.
+    reserve_payload(a, a->payload_length + words + 2);
+    uint64_t* out = a->payload + a->payload_length;
+    memset(out, 0, (words + 2) * sizeof(uint64_t));
+
+    for(size_t i = 0; i < PACKED_BLOCK_SIZE && bits; ++i)
+    {
+        size_t pos = i * bits;
+        out[pos / 64] |= v[i] << (pos % 64);
+        if(pos % 64 + bits > 64)
+            out[pos / 64 + 1] |= v[i] >> (64 - pos % 64);
+    }
+
+    a->payload_length += words;
+    a->tail_length = 0;
+}
+
+size_t length(PackedArray* a)
+{
+    return a->block_count * PACKED_BLOCK_SIZE + a->tail_length;
+}
+
+void init(PackedArray* a, PackedMode mode)
+{
+    a->mode = mode;
+
+    a->block_count = 0;
+    a->block_capacity = 0;
+    a->blocks = NULL;
+
+    a->payload_length = 0;
+    a->payload_capacity = 0;
+    a->payload = NULL;
+
+    a->tail_length = 0;
+}
+
+void destroy(PackedArray* a)
+{
+    free(a->blocks);
+    free(a->payload);
+}
+
+void pcopy(PackedArray* a)
+{
+    if(a->blocks)
+    {
+        // BUG: No OOM checking.
+        PackedBlock* blocks = malloc(a->block_capacity * sizeof(PackedBlock));
+        memcpy(blocks, a->blocks, a->block_count * sizeof(PackedBlock));
+        a->blocks = blocks;
+
+        uint64_t* payload = malloc(a->payload_capacity * sizeof(uint64_t));
+        memcpy(payload, a->payload, (a->payload_length + 2) * sizeof(uint64_t));
+        a->payload = payload;
+    }
+}
+
+void append(PackedArray* a, uint64_t v)
+{
+    // FASTPATH
+    a->tail[a->tail_length++] = v;
+
+    if(a->tail_length == PACKED_BLOCK_SIZE)
+        flush_tail(a);
+}
+
+// Unpacks block `b' into `out', which must have room for PACKED_BLOCK_SIZE
+// elements.
+void decode(PackedArray* a, size_t b, uint64_t* out)
+{
+    assert(b < a->block_count);
+
+    const PackedBlock* blk = &a->blocks[b];
+    const uint64_t* w = a->payload + blk->offset;
+    uint64_t mask = low_mask(blk->bits);
+    size_t i = 0;
+
+#ifdef __AVX2__
+    // Four lanes at a time: gather each lane's two candidate words, shift
+    // them into place (a shift by 64 yields zero, so no lane needs a branch),
+    // and mask.
+    __m256i vmask = _mm256_set1_epi64x((long long)mask);
+    __m256i step = _mm256_set_epi64x(3 * blk->bits, 2 * blk->bits,
+                                     blk->bits, 0);
+    __m256i sixty_four = _mm256_set1_epi64x(64);
+
+    for(; i + 4 <= PACKED_BLOCK_SIZE; i += 4)
+    {
+        __m256i pos = _mm256_add_epi64(_mm256_set1_epi64x((long long)(i * blk->bits)),
+                                       step);
+        __m256i word = _mm256_srli_epi64(pos, 6);
+        __m256i shift = _mm256_and_si256(pos, _mm256_set1_epi64x(63));
+
+        __m256i lo = _mm256_i64gather_epi64((const long long*)w, word, 8);
+        __m256i hi = _mm256_i64gather_epi64((const long long*)(w + 1), word, 8);
+
+        __m256i v = _mm256_or_si256(
+            _mm256_srlv_epi64(lo, shift),
+            _mm256_sllv_epi64(hi, _mm256_sub_epi64(sixty_four, shift)));
+
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_and_si256(v, vmask));
+    }
+#endif
+
+    for(; i < PACKED_BLOCK_SIZE; ++i)
+        out[i] = extract(w, i * blk->bits, mask);
+
+    // Undo the encoding. FOR vectorizes; delta is a prefix sum.
+    if(a->mode == PACKED_FOR)
+    {
+        for(i = 0; i < PACKED_BLOCK_SIZE; ++i)
+            out[i] += blk->base;
+    }
+    else
+    {
+        out[0] = blk->base;
+        for(i = 1; i < PACKED_BLOCK_SIZE; ++i)
+            out[i] += out[i - 1];
+    }
+}
+
+// Returns element `i'.
+uint64_t get(PackedArray* a, size_t i)
+{
+    assert(i < length(a));
+
+    size_t b = i / PACKED_BLOCK_SIZE;
+    size_t k = i % PACKED_BLOCK_SIZE;
+
+    if(b == a->block_count)
+        return a->tail[k];
+
+    const PackedBlock* blk = &a->blocks[b];
+    const uint64_t* w = a->payload + blk->offset;
+    uint64_t mask = low_mask(blk->bits);
+
+    if(a->mode == PACKED_FOR)
+        return blk->base + extract(w, k * blk->bits, mask);
+
+    // Delta: the sum of every delta up to and including this one.
+    uint64_t v = blk->base;
+    for(size_t j = 1; j <= k; ++j)
+        v += extract(w, j * blk->bits, mask);
+    return v;
+}
+
+void foreach(PackedArray* a, void (*iter)(const uint64_t*, void*), void* aux)
+{
+    uint64_t buf[PACKED_BLOCK_SIZE];
+
+    for(size_t b = 0; b < a->block_count; ++b)
+    {
+        decode(a, b, buf);
+
+        for(size_t i = 0; i < PACKED_BLOCK_SIZE; ++i)
+            iter(buf + i, aux);
+    }
+
+    for(size_t i = 0; i < a->tail_length; ++i)
+        iter(a->tail + i, aux);
+}
@@ -0,0 +1,572 @@
+// pvector.c: Defines NewLang's persistent vector type.
+//
+// A PVector is immutable. Every "modifying" operation leaves its input alone
+// and returns a new vector, which shares all but O(log n) of its memory with
+// the input. This is what lets `pure' functions take and return sequences
+// without an O(n) pcopy at every step.
+//
+// It is a relaxed radix balanced (RRB) tree: a 32-way tree whose leaves hold
+// the elements, and whose internal nodes each carry a table of the cumulative
+// sizes of their children. Since the sizes are tabulated, nodes needn't be
+// full, which is what makes concat and slice O(log n) instead of O(n):
+//
+//   get, set, push_back - O(log32 n). Descending a level guesses the child
+//                         by radix (as if the tree were dense), then steps
+//                         forward through the size table; in a near-dense
+//                         tree the guess is almost always right.
+//   concat              - O(log32 n). The two trees are zipped together down
+//                         the seam where they meet, and only the nodes along
+//                         it are rebuilt. Leaves on the seam are refilled, so
+//                         concatenating many small vectors still yields
+//                         mostly full leaves.
+//   slice               - O(log32 n). Only the nodes along the two cut paths
+//                         are rebuilt.
+//   foreach_chunk       - Iterates a leaf (up to 32 contiguous elements) at a
+//                         time.
+//
+// Nodes are reference counted, so pcopy of a PVector is O(1). The counts are
+// not atomic; a vector must not be shared between threads.
+//
+// Leaves own their elements. An element is pcopy'd when it is copied into a
+// new leaf, and destroyed when the last leaf holding it is freed.
+#include <stddef.h>
+#include <stdbool.h>
+
+#define PV_BITS     5
+#define PV_WIDTH    (1 << PV_BITS)
+
+struct PLeaf
+{
+    size_t refs;
+    size_t count;
+    Value elems[PV_WIDTH];
+};
+
+struct PNode
+{
+    size_t refs;
+    size_t count;
+    // sizes[c] is the number of elements in children 0 through c.
+    size_t sizes[PV_WIDTH];
+    void* children[PV_WIDTH];
+};
+
+struct PVector
+{
+    size_t length;
+    // 0 when the root is a leaf.
+    size_t height;
+    // NULL when the vector is empty.
+    void* root;
+};
+
+static size_t node_size(void* n, size_t h)
+{
+    if(h == 0)
+        return ((PLeaf*)n)->count;
+
+    PNode* in = n;
+    return in->sizes[in->count - 1];
+}
+
+static void incref(void* n)
+{
+    // Both node types start with their reference count.
+    ++*(size_t*)n;
+}
+
+static void decref(void* n, size_t h)
+{
+    if(--*(size_t*)n != 0)
+        return;
+
+    if(h == 0)
+    {
+        PLeaf* l = n;
+        destroy_elems(l->elems, l->count);
+    }
+    else
+    {
+        PNode* in = n;
+        for(size_t c = 0; c < in->count; ++c)
+            decref(in->children[c], h - 1);
+    }
+
+    free(n);
+}
+
+static PLeaf* new_leaf(void)
+{
+    // BUG: No OOM checking.
+    PLeaf* l = malloc(sizeof(PLeaf));
+    l->refs = 1;
+    l->count = 0;
+    return l;
+}
+
+static PNode* new_node(void)
+{
+    // BUG: No OOM checking.
+    PNode* in = malloc(sizeof(PNode));
+    in->refs = 1;
+    in->count = 0;
+    return in;
+}
+
+// Copies `n' elements into the end of `l', as new copies.
+static void leaf_append(PLeaf* l, const Value* v, size_t n)
+{
+    assert(l->count + n <= PV_WIDTH);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        l->elems[l->count] = v[i];
+        pcopy(&l->elems[l->count]);
+        ++l->count;
+    }
+}
+
+static PLeaf* copy_leaf(PLeaf* src)
+{
+    PLeaf* l = new_leaf();
+    leaf_append(l, src->elems, src->count);
+    return l;
+}
+
+// Appends a child of height `h - 1' to `in'. The node takes over the caller's
+// reference to it.
+static void node_append(PNode* in, void* child, size_t h)
+{
+    assert(in->count < PV_WIDTH);
+
+    size_t before = in->count ? in->sizes[in->count - 1] : 0;
+    in->children[in->count] = child;
+    in->sizes[in->count] = before + node_size(child, h - 1);
+    ++in->count;
+}
+
+static PNode* copy_node(PNode* src)
+{
+    PNode* in = new_node();
+    in->count = src->count;
+    memcpy(in->sizes, src->sizes, src->count * sizeof(size_t));
+    memcpy(in->children, src->children, src->count * sizeof(void*));
+
+    for(size_t c = 0; c < in->count; ++c)
+        incref(in->children[c]);
+
+    return in;
+}
+
+// Returns the child of `in' (at height `h') holding element `i', and rebases
+// `i' onto that child.
+static size_t child_index(PNode* in, size_t h, size_t* i)
+{
+    // A child at height h - 1 holds at most PV_WIDTH^h elements, so the radix
+    // guess can only undershoot.
+    size_t c = *i >> (PV_BITS * h);
+    if(c >= in->count)
+        c = in->count - 1;
+
+    while(in->sizes[c] <= *i)
+        ++c;
+
+    if(c > 0)
+        *i -= in->sizes[c - 1];
+    return c;
+}
+
+// A chain of `h' single-child nodes over a leaf holding only `v'.
+static void* new_path(size_t h, const Value* v)
+{
+    PLeaf* l = new_leaf();
+    leaf_append(l, v, 1);
+
+    void* n = l;
+    for(size_t k = 1; k <= h; ++k)
+    {
+        PNode* in = new_node();
+        node_append(in, n, k);
+        n = in;
+    }
+    return n;
+}
+
+size_t length(PVector* v)
+{
+    return v->length;
+}
+
+void init(PVector* v)
+{
+    v->length = 0;
+    v->height = 0;
+    v->root = NULL;
+}
+
+void destroy(PVector* v)
+{
+    if(v->root)
+        decref(v->root, v->height);
+}
+
+// Copying a vector just shares its tree.
+void pcopy(PVector* v)
+{
+    if(v->root)
+        incref(v->root);
+}
+
+// Returns a pointer to element `i'. The element MUST NOT be modified through
+// it, since other vectors may share it.
+const Value* get(PVector* v, size_t i)
+{
+    assert(i < v->length);
+
+    void* n = v->root;
+    for(size_t h = v->height; h > 0; --h)
+    {
+        PNode* in = n;
+        n = in->children[child_index(in, h, &i)];
+    }
+
+    return &((PLeaf*)n)->elems[i];
+}
+
+static void* set_rec(void* n, size_t h, size_t i, const Value* val)
+{
+    if(h == 0)
+    {
+        PLeaf* l = copy_leaf(n);
+        destroy(&l->elems[i]);
+        l->elems[i] = *val;
+        pcopy(&l->elems[i]);
+        return l;
+    }
+
+    PNode* in = copy_node(n);
+    size_t c = child_index(in, h, &i);
+
+    void* old = in->children[c];
+    in->children[c] = set_rec(old, h - 1, i, val);
+    decref(old, h - 1);
+    return in;
+}
+
+// Returns a copy of `v' with element `i' replaced by `val'.
+PVector set(PVector* v, size_t i, const Value* val)
+{
+    assert(i < v->length);
+
+    PVector ret = { v->length, v->height, set_rec(v->root, v->height, i, val) };
+    return ret;
+}
+
+// Returns `n' with `val' appended along its rightmost path, or NULL if that
+// path is full all the way down.
+static void* push_rec(void* n, size_t h, const Value* val)
+{
+    if(h == 0)
+    {
+        PLeaf* l = n;
+        if(l->count == PV_WIDTH)
+            return NULL;
+
+        PLeaf* ret = copy_leaf(l);
+        leaf_append(ret, val, 1);
+        return ret;
+    }
+
+    PNode* in = n;
+    size_t last = in->count - 1;
+
+    void* pushed = push_rec(in->children[last], h - 1, val);
+    if(pushed)
+    {
+        PNode* ret = copy_node(in);
+        decref(ret->children[last], h - 1);
+        ret->children[last] = pushed;
+        ++ret->sizes[last];
+        return ret;
+    }
+
+    if(in->count == PV_WIDTH)
+        return NULL;
+
+    PNode* ret = copy_node(in);
+    node_append(ret, new_path(h - 1, val), h);
+    return ret;
+}
+
+// Returns a copy of `v' with `val' appended.
+PVector push_back(PVector* v, const Value* val)
+{
+    PVector ret = { v->length + 1, v->height, NULL };
+
+    if(v->root == NULL)
+    {
+        ret.root = new_path(0, val);
+        return ret;
+    }
+
+    ret.root = push_rec(v->root, v->height, val);
+    if(ret.root)
+        return ret;
+
+    // The tree is full. Grow a new root over it.
+    PNode* top = new_node();
+    incref(v->root);
+    node_append(top, v->root, v->height + 1);
+    node_append(top, new_path(v->height, val), v->height + 1);
+
+    ret.height = v->height + 1;
+    ret.root = top;
+    return ret;
+}
+
+// Joins two leaves into one or two. If they don't fit in one, the first is
+// filled up from the second, so that leaves along a seam stay dense.
+static size_t merge_leaves(PLeaf* l, PLeaf* r, void* out[2])
+{
+    if(l->count == PV_WIDTH)
+    {
+        incref(l);
+        incref(r);
+        out[0] = l;
+        out[1] = r;
+        return 2;
+    }
+
+    PLeaf* a = copy_leaf(l);
+    size_t moved = PV_WIDTH - a->count;
+    if(moved > r->count)
+        moved = r->count;
+
+    leaf_append(a, r->elems, moved);
+    out[0] = a;
+
+    if(moved == r->count)
+        return 1;
+
+    PLeaf* b = new_leaf();
+    leaf_append(b, r->elems + moved, r->count - moved);
+    out[1] = b;
+    return 2;
+}
+
+// Packs `n' (at most 2 * PV_WIDTH) children of height `h - 1' into one or two
+// nodes of height `h'. Takes over the references to the children.
+static size_t pack(void** kids, size_t n, size_t h, void* out[2])
+{
+    PNode* a = new_node();
+    size_t first = n < PV_WIDTH ? n : PV_WIDTH;
+
+    for(size_t c = 0; c < first; ++c)
+        node_append(a, kids[c], h);
+    out[0] = a;
+
+    if(n == first)
+        return 1;
+
+    PNode* b = new_node();
+    for(size_t c = first; c < n; ++c)
+        node_append(b, kids[c], h);
+    out[1] = b;
+    return 2;
+}
+
+// Concatenates `l' (of height `hl') and `r' (of height `hr') into one or two
+// nodes of height max(hl, hr), written to `out'. Only the nodes along the
+// seam are rebuilt; everything either side of it is shared.
+static size_t concat_rec(void* l, size_t hl, void* r, size_t hr, void* out[2])
+{
+    if(hl == 0 && hr == 0)
+        return merge_leaves(l, r, out);
+
+    size_t h = hl > hr ? hl : hr;
+    void* kids[2 * PV_WIDTH];
+    size_t n = 0;
+
+    void* seam[2];
+    size_t m;
+
+    PNode* L = hl == h ? l : NULL;
+    PNode* R = hr == h ? r : NULL;
+
+    // Whichever side is at height `h' contributes its children, except for
+    // the one on the seam, which is merged one level down.
+    void* seam_l = L ? L->children[L->count - 1] : l;
+    void* seam_r = R ? R->children[0] : r;
+    m = concat_rec(seam_l, L ? hl - 1 : hl, seam_r, R ? hr - 1 : hr, seam);
+
+    if(L)
+    {
+        for(size_t c = 0; c + 1 < L->count; ++c)
+        {
+            incref(L->children[c]);
+            kids[n++] = L->children[c];
+        }
+    }
+
+    for(size_t k = 0; k < m; ++k)
+        kids[n++] = seam[k];
+
+    if(R)
+    {
+        for(size_t c = 1; c < R->count; ++c)
+        {
+            incref(R->children[c]);
+            kids[n++] = R->children[c];
+        }
+    }
+
+    return pack(kids, n, h, out);
+}
+
+// Returns the concatenation of `a' and `b'.
+PVector concat(PVector* a, PVector* b)
+{
+    if(a->root == NULL)
+    {
+        pcopy(b);
+        return *b;
+    }
+    if(b->root == NULL)
+    {
+        pcopy(a);
+        return *a;
+    }
+
+    void* out[2];
+    size_t n = concat_rec(a->root, a->height, b->root, b->height, out);
+    size_t h = a->height > b->height ? a->height : b->height;
+
+    PVector ret = { a->length + b->length, h, out[0] };
+    if(n == 2)
+    {
+        PNode* top = new_node();
+        node_append(top, out[0], h + 1);
+        node_append(top, out[1], h + 1);
+
+        ret.height = h + 1;
+        ret.root = top;
+    }
+    return ret;
+}
+
+// Returns the first `k' elements of `n', where 0 < k <= node_size(n, h).
+static void* take_rec(void* n, size_t h, size_t k)
+{
+    if(k == node_size(n, h))
+    {
+        incref(n);
+        return n;
+    }
+
+    if(h == 0)
+    {
+        PLeaf* l = new_leaf();
+        leaf_append(l, ((PLeaf*)n)->elems, k);
+        return l;
+    }
+
+    PNode* in = n;
+    size_t i = k - 1;
+    size_t c = child_index(in, h, &i);
+
+    PNode* ret = new_node();
+    for(size_t d = 0; d < c; ++d)
+    {
+        incref(in->children[d]);
+        node_append(ret, in->children[d], h);
+    }
+    node_append(ret, take_rec(in->children[c], h - 1, i + 1), h);
+    return ret;
+}
+
+// Returns all but the first `k' elements of `n', where k < node_size(n, h).
+static void* drop_rec(void* n, size_t h, size_t k)
+{
+    if(k == 0)
+    {
+        incref(n);
+        return n;
+    }
+
+    if(h == 0)
+    {
+        PLeaf* src = n;
+        PLeaf* l = new_leaf();
+        leaf_append(l, src->elems + k, src->count - k);
+        return l;
+    }
+
+    PNode* in = n;
+    size_t i = k;
+    size_t c = child_index(in, h, &i);
+
+    PNode* ret = new_node();
+    node_append(ret, drop_rec(in->children[c], h - 1, i), h);
+    for(size_t d = c + 1; d < in->count; ++d)
+    {
+        incref(in->children[d]);
+        node_append(ret, in->children[d], h);
+    }
+    return ret;
+}
+
+// Returns elements [from, to) of `v'.
+PVector slice(PVector* v, size_t from, size_t to)
+{
+    assert(from <= to && to <= v->length);
+
+    PVector ret;
+    init(&ret);
+    if(from == to)
+        return ret;
+
+    void* taken = take_rec(v->root, v->height, to);
+    ret.root = drop_rec(taken, v->height, from);
+    ret.height = v->height;
+    ret.length = to - from;
+    decref(taken, v->height);
+
+    // Cutting can leave a chain of single-child nodes at the top.
+    while(ret.height > 0 && ((PNode*)ret.root)->count == 1)
+    {
+        PNode* top = ret.root;
+        void* child = top->children[0];
+
+        incref(child);
+        decref(top, ret.height);
+
+        ret.root = child;
+        --ret.height;
+    }
+
+    return ret;
+}
+
+static void foreach_rec(void* n, size_t h,
+                        void (*iter)(const Value*, size_t, void*), void* aux)
+{
+    if(h == 0)
+    {
+        PLeaf* l = n;
+        iter(l->elems, l->count, aux);
+        return;
+    }
+
+    PNode* in = n;
+    for(size_t c = 0; c < in->count; ++c)
+        foreach_rec(in->children[c], h - 1, iter, aux);
+}
+
+// Calls `iter' once per leaf, in order, with a run of up to PV_WIDTH
+// contiguous elements.
+void foreach_chunk(PVector* v, void (*iter)(const Value*, size_t, void*),
+                   void* aux)
+{
+    if(v->root)
+        foreach_rec(v->root, v->height, iter, aux);
+}
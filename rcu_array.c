@@ -0,0 +1,350 @@
+// rcu_array.c: Defines NewLang's read-mostly array type.
+//
+// An RcuArray is for data that is read constantly and changed rarely, like a
+// routing table. Readers never lock, never write shared memory, and never
+// execute an atomic read-modify-write: taking a snapshot is one pointer load.
+//
+// That works because a version, once published, is never modified. A writer
+// builds the next version off to the side and swaps the `current' pointer to
+// it. Readers holding the old version keep using it undisturbed; readers
+// which load the pointer afterwards get the new one.
+//
+// The catch is knowing when nobody holds the old version any more, so that it
+// can be freed. This uses quiescent-state-based reclamation (QSBR):
+//
+//   - There is a global epoch, bumped by every publish. A version retired by
+//     a publish is tagged with the epoch that publish moved to.
+//   - Each reader thread registers once, and calls quiescent() every so often
+//     at a point where it holds no snapshot (between requests, say). That
+//     records the epoch the reader has caught up to, in its own cache line.
+//   - A retired version can be freed once every registered reader has caught
+//     up to its epoch, since none of them can still be holding it.
+//
+// A reader which goes idle calls offline(), so it doesn't hold up
+// reclamation, and online() before its next snapshot.
+//
+// Writers are serialized by a mutex. Publishing copies the whole array, so
+// this is only a win when reads outnumber writes by a wide margin.
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// The most reader threads that may be registered at once.
+#define RCU_READERS_MAX     64
+
+#define CACHE_LINE          64
+
+// A reader's epoch while it's offline. It never holds anything back.
+#define RCU_OFFLINE         SIZE_MAX
+
+// One immutable version of the array's contents.
+struct RcuVersion
+{
+    // Only used once retired: the epoch every reader must reach before this
+    // version is freed, and the next retired version.
+    size_t retired_epoch;
+    RcuVersion* next;
+
+    size_t length;
+    Value elems[];
+};
+
+struct RcuReader
+{
+    // Each reader writes only its own line, so quiescent() never contends.
+    _Alignas(CACHE_LINE) atomic_size_t epoch;
+    atomic_bool registered;
+};
+
+struct RcuArray
+{
+    // Readers only ever touch this (and their own RcuReader).
+    _Alignas(CACHE_LINE) _Atomic(RcuVersion*) current;
+
+    _Alignas(CACHE_LINE) atomic_size_t epoch;
+    pthread_mutex_t writer_lock;
+    // Oldest first. Only touched with writer_lock held.
+    RcuVersion* retired_head;
+    RcuVersion* retired_tail;
+
+    RcuReader readers[RCU_READERS_MAX];
+};
+
+static RcuVersion* new_version(size_t n)
+{
+    // BUG: No OOM checking.
+    RcuVersion* v = malloc(sizeof(RcuVersion) + n * sizeof(Value));
+    v->retired_epoch = 0;
+    v->next = NULL;
+    v->length = n;
+    return v;
+}
+
+static void free_version(RcuVersion* v)
+{
+    destroy_elems(v->elems, v->length);
+
+    free(v);
+}
+
+// The oldest epoch any registered, online reader might still be in.
+static size_t min_reader_epoch(RcuArray* r)
+{
+    size_t min = RCU_OFFLINE;
+
+    for(size_t i = 0; i < RCU_READERS_MAX; ++i)
+    {
+        if(!atomic_load_explicit(&r->readers[i].registered, memory_order_acquire))
+            continue;
+
+        size_t e = atomic_load_explicit(&r->readers[i].epoch,
+                                        memory_order_acquire);
+        if(e < min)
+            min = e;
+    }
+
+    return min;
+}
+
+// Frees every retired version that no reader can still hold. MUST be called
+// with writer_lock held.
+static void reclaim(RcuArray* r)
+{
+    size_t safe = min_reader_epoch(r);
+
+    // Versions are retired in epoch order, so stop at the first one that
+    // isn't safe yet.
+    while(r->retired_head && r->retired_head->retired_epoch <= safe)
+    {
+        RcuVersion* v = r->retired_head;
+        r->retired_head = v->next;
+        free_version(v);
+    }
+
+    if(!r->retired_head)
+        r->retired_tail = NULL;
+}
+
+// Like a ConcurrentArray, an RcuArray is initialized in place, wherever all of
+// its threads can reach it. It starts out empty.
+void init(RcuArray* r)
+{
+    atomic_init(&r->current, new_version(0));
+    atomic_init(&r->epoch, 0);
+    pthread_mutex_init(&r->writer_lock, NULL);
+    r->retired_head = NULL;
+    r->retired_tail = NULL;
+
+    for(size_t i = 0; i < RCU_READERS_MAX; ++i)
+    {
+        atomic_init(&r->readers[i].epoch, RCU_OFFLINE);
+        atomic_init(&r->readers[i].registered, false);
+    }
+}
+
+// MUST only be called once every reader has unregistered.
+void destroy(RcuArray* r)
+{
+    while(r->retired_head)
+    {
+        RcuVersion* v = r->retired_head;
+        r->retired_head = v->next;
+        free_version(v);
+    }
+
+    free_version(atomic_load(&r->current));
+    pthread_mutex_destroy(&r->writer_lock);
+}
+
+// Returns the current version. This is the entire read path: a single load,
+// which on x86 is a plain mov. The snapshot stays valid until this reader's
+// next call to quiescent() or offline().
+const RcuVersion* snapshot(RcuArray* r)
+{
+    return atomic_load_explicit(&r->current, memory_order_acquire);
+}
+
+size_t length(const RcuVersion* v)
+{
+    return v->length;
+}
+
+const Value* index(const RcuVersion* v, size_t i)
+{
+    assert(i < v->length);
+
+    return &v->elems[i];
+}
+
+// Declares that this reader holds no snapshots. Readers MUST call this
+// regularly, or retired versions pile up.
+void quiescent(RcuArray* r, RcuReader* rd)
+{
+    // Only this thread writes its epoch, so this is a plain store.
+    atomic_store_explicit(&rd->epoch,
+                          atomic_load_explicit(&r->epoch, memory_order_acquire),
+                          memory_order_release);
+}
+
+// Declares that this reader will take no snapshots until online().
+void offline(RcuReader* rd)
+{
+    atomic_store_explicit(&rd->epoch, RCU_OFFLINE, memory_order_release);
+}
+
+void online(RcuArray* r, RcuReader* rd)
+{
+    quiescent(r, rd);
+
+    // The epoch store must be visible before this reader loads `current', or
+    // a writer could free the version it is about to load.
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+// Registers the calling thread as a reader, and returns its handle. The
+// reader starts out online.
+RcuReader* register_reader(RcuArray* r)
+{
+    for(size_t i = 0; i < RCU_READERS_MAX; ++i)
+    {
+        RcuReader* rd = &r->readers[i];
+        bool expected = false;
+
+        // A freshly claimed slot is still offline, so it holds nothing back
+        // until online() gives it a real epoch.
+        if(atomic_compare_exchange_strong(&rd->registered, &expected, true))
+        {
+            online(r, rd);
+            return rd;
+        }
+    }
+
+    // BUG: No handling of more than RCU_READERS_MAX readers.
+    assert(false);
+    return NULL;
+}
+
+void unregister_reader(RcuReader* rd)
+{
+    atomic_store_explicit(&rd->epoch, RCU_OFFLINE, memory_order_release);
+    atomic_store_explicit(&rd->registered, false, memory_order_release);
+}
+
+// Swaps in `next' and retires the version it replaces. MUST be called with
+// writer_lock held.
+static void publish_locked(RcuArray* r, RcuVersion* next)
+{
+    RcuVersion* old = atomic_exchange_explicit(&r->current, next,
+                                               memory_order_acq_rel);
+
+    // Any reader still holding `old' loaded it before the exchange, so it
+    // will have to pass through a quiescent state (and pick up this epoch)
+    // before it lets go.
+    old->retired_epoch = atomic_fetch_add_explicit(&r->epoch, 1,
+                                                   memory_order_acq_rel) + 1;
+
+    if(r->retired_tail)
+        r->retired_tail->next = old;
+    else
+        r->retired_head = old;
+    r->retired_tail = old;
+
+    // Pairs with the fence in online(). Without both, the exchange above and
+    // the scan of reader epochs in reclaim() may be reordered: a reader just
+    // coming online could load `old' while we still see it as offline, and
+    // free `old' out from under it.
+    atomic_thread_fence(memory_order_seq_cst);
+
+    reclaim(r);
+}
+
+// Copies the elements of `a' into a new version, pcopy'ing each.
+static RcuVersion* version_of(Array* a)
+{
+    size_t n = length(a);
+    RcuVersion* v = new_version(n);
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        v->elems[i] = *index(a, i);
+        pcopy(&v->elems[i]);
+    }
+
+    return v;
+}
+
+// Moves the elements of `a' into a new version, without copying them again,
+// and leaves `a' empty.
+static RcuVersion* version_from(Array* a)
+{
+    RcuVersion* v = new_version(length(a));
+
+    memcpy(v->elems, a->static_elems, a->static_length * sizeof(Value));
+    memcpy(v->elems + a->static_length, a->dynamic_elems,
+           a->dynamic_length * sizeof(Value));
+
+    a->static_length = 0;
+    a->dynamic_length = 0;
+    return v;
+}
+
+// Replaces the contents with a copy of `a'. The elements are pcopy'd into the
+// new version, so the caller keeps ownership of `a'.
+void publish(RcuArray* r, Array* a)
+{
+    // Build the copy before taking the lock, to keep other writers waiting
+    // as briefly as possible.
+    RcuVersion* next = version_of(a);
+
+    pthread_mutex_lock(&r->writer_lock);
+    publish_locked(r, next);
+    pthread_mutex_unlock(&r->writer_lock);
+}
+
+// Builds the next version from the current one: the current contents are
+// copied into `scratch' (which MUST be empty), `edit' changes it, and the
+// result is published. Writers are serialized, so no update is lost.
+//
+// The elements of `scratch' are moved into the new version, not copied, so
+// each element is pcopy'd once per update. `scratch' is left empty, but may
+// still hold its dynamic half's allocation, which it keeps for the next
+// update; destroy() it when done.
+void update(RcuArray* r, Array* scratch, void (*edit)(Array*, void*),
+            void* aux)
+{
+    assert(length(scratch) == 0);
+
+    pthread_mutex_lock(&r->writer_lock);
+
+    // Only writers swap `current', and we hold the lock.
+    RcuVersion* cur = atomic_load_explicit(&r->current, memory_order_relaxed);
+    for(size_t i = 0; i < cur->length; ++i)
+    {
+        Value v = cur->elems[i];
+        pcopy(&v);
+        append(scratch, &v);
+    }
+
+    edit(scratch, aux);
+
+    // Publish before letting go of the lock, so that no other writer's
+    // update can land in between and be overwritten.
+    publish_locked(r, version_from(scratch));
+
+    pthread_mutex_unlock(&r->writer_lock);
+}
+
+// Frees whatever retired versions it now can, without publishing. Useful
+// after a burst of publishes, once readers have caught up.
+void synchronize(RcuArray* r)
+{
+    pthread_mutex_lock(&r->writer_lock);
+
+    // See publish_locked().
+    atomic_thread_fence(memory_order_seq_cst);
+    reclaim(r);
+
+    pthread_mutex_unlock(&r->writer_lock);
+}
@@ -0,0 +1,246 @@
+// segmented_array.c: Defines NewLang's segmented array type.
+//
+// A SegmentedArray is an Array (see array.c) whose dynamic half is never
+// moved. Instead of one buffer which is realloc'd on growth, the dynamic half
+// is a list of chunks, each twice the size of the one before it:
+//
+//   chunk 0: SEGMENT_SIZE_MIN elements
+//   chunk 1: SEGMENT_SIZE_MIN*2 elements
+//   chunk k: SEGMENT_SIZE_MIN*2^k elements
+//
+// Growth allocates a new chunk and leaves the old ones alone, so:
+//   - A pointer returned by index() stays valid until that element is removed.
+//     Long-lived structures may safely point into the array.
+//   - Growing never copies elements. Only the (tiny) chunk table is realloc'd.
+//   - Random access is still O(1). Because the chunk sizes are powers of two,
+//     the chunk holding element `i' is found with a single count-leading-zeros
+//     instruction, rather than a search.
+//
+// The price is one extra dependent load per dynamic access (the chunk table),
+// and iteration which is contiguous per-chunk instead of across the whole
+// dynamic half.
+#include <stddef.h>
+#include <stdbool.h>
+
+// The size of the first chunk of the dynamic half. This MUST be a power of
+// two, since index() relies on it.
+#define SEGMENT_SIZE_MIN        16
+#define SEGMENT_SIZE_MIN_LOG2   4
+
+struct SegmentedArray
+{
+    size_t dynamic_length;
+    size_t chunk_count;
+    Value** chunks;
+
+    size_t static_length;
+    size_t static_capacity;
+    Value static_elems[];
+};
+
+// The index (within the dynamic half) of the first element of chunk `k'.
+static size_t chunk_start(size_t k)
+{
+    return SEGMENT_SIZE_MIN * (((size_t)1 << k) - 1);
+}
+
+static size_t chunk_size(size_t k)
+{
+    return (size_t)SEGMENT_SIZE_MIN << k;
+}
+
+// The total number of elements the dynamic half can hold without allocating.
+static size_t dynamic_capacity(SegmentedArray* a)
+{
+    return chunk_start(a->chunk_count);
+}
+
+// Finds the element at index `i' of the dynamic half. Shifting `i' by
+// SEGMENT_SIZE_MIN makes chunk `k' cover exactly the indices with their top
+// bit at position k + SEGMENT_SIZE_MIN_LOG2, so the chunk number is read
+// straight off the bit length, and the offset is whatever remains below it.
+static Value* dynamic_index(SegmentedArray* a, size_t i)
+{
+    size_t t = i + SEGMENT_SIZE_MIN;
+    size_t top = (sizeof(size_t) * 8 - 1) - __builtin_clzl(t);
+
+    size_t k = top - SEGMENT_SIZE_MIN_LOG2;
+    size_t offset = t - ((size_t)1 << top);
+
+    return &a->chunks[k][offset];
+}
+
+static void push_chunk(SegmentedArray* a)
+{
+    size_t k = a->chunk_count;
+
+    // BUG: No OOM checking.
+    a->chunks = realloc(a->chunks, (k + 1) * sizeof(Value*));
+    a->chunks[k] = malloc(chunk_size(k) * sizeof(Value));
+    a->chunk_count = k + 1;
+}
+
+static void pop_chunk(SegmentedArray* a)
+{
+    assert(a->chunk_count > 0);
+
+    free(a->chunks[--a->chunk_count]);
+
+    // The chunk table itself is only released with the last chunk. Shrinking
+    // it in between isn't worth the realloc.
+    if(a->chunk_count == 0)
+    {
+        free(a->chunks);
+        a->chunks = NULL;
+    }
+}
+
+size_t length(SegmentedArray* a)
+{
+    return a->static_length + a->dynamic_length;
+}
+
+void reserve(SegmentedArray* a, size_t capacity)
+{
+    if(capacity <= length(a))
+        return;
+
+    if(capacity <= a->static_capacity)
+        return;
+
+    while(dynamic_capacity(a) < capacity - a->static_capacity)
+        push_chunk(a);
+}
+
+// `a' MUST be allocated in the parent function with the same stub as an Array.
+void init(SegmentedArray* a)
+{
+    a->dynamic_length = 0;
+    a->chunk_count = 0;
+    a->chunks = NULL;
+
+    a->static_length = 0;
+    // a->static_capacity was set in assembly.
+    // a->static_elems can be left undefined.
+}
+
+void destroy(SegmentedArray* a)
+{
+    destroy_elems(a->static_elems, a->static_length);
+
+    // One batch per chunk.
+    size_t remaining = a->dynamic_length;
+    for(size_t k = 0; remaining > 0; ++k)
+    {
+        size_t n = remaining < chunk_size(k) ? remaining : chunk_size(k);
+        destroy_elems(a->chunks[k], n);
+        remaining -= n;
+    }
+
+    while(a->chunk_count > 0)
+        pop_chunk(a);
+}
+
+void pcopy(SegmentedArray* a)
+{
+    if(a->chunks)
+    {
+        // BUG: No OOM checking.
+        Value** new_chunks = malloc(a->chunk_count * sizeof(Value*));
+        for(size_t k = 0; k < a->chunk_count; ++k)
+        {
+            new_chunks[k] = malloc(chunk_size(k) * sizeof(Value));
+            memcpy(new_chunks[k], a->chunks[k], chunk_size(k) * sizeof(Value));
+        }
+        a->chunks = new_chunks;
+    }
+
+    for(size_t i = 0; i < a->static_length; ++i)
+        pcopy(&a->static_elems[i]);
+    for(size_t i = 0; i < a->dynamic_length; ++i)
+        pcopy(dynamic_index(a, i));
+}
+
+void append(SegmentedArray* a, const Value* v)
+{
+    // FASTPATH
+    if(a->static_length < a->static_capacity)
+    {
+        a->static_elems[a->static_length++] = *v;
+        return;
+    }
+
+    // Every chunk is full. Add another one; nothing already stored moves.
+    if(a->dynamic_length == dynamic_capacity(a))
+        push_chunk(a);
+
+    *dynamic_index(a, a->dynamic_length++) = *v;
+}
+
+void foreach(SegmentedArray* a, void (*iter)(Value*, void*), void* aux)
+{
+    for(size_t i = 0; i < a->static_length; ++i)
+        iter(a->static_elems + i, aux);
+
+    // Walk chunk by chunk, so that the inner loop is still contiguous.
+    size_t remaining = a->dynamic_length;
+    for(size_t k = 0; remaining > 0; ++k)
+    {
+        size_t n = remaining < chunk_size(k) ? remaining : chunk_size(k);
+
+        for(size_t i = 0; i < n; ++i)
+            iter(a->chunks[k] + i, aux);
+
+        remaining -= n;
+    }
+}
+
+// Returns a pointer to the value at index `i'. The pointer remains valid until
+// the element is removed, no matter how much the array grows in the meantime.
+// This entire function should be inlined by the compiler.
+Value* index(SegmentedArray* a, size_t i)
+{
+    assert(i < length(a));
+
+    if(i < a->static_length)
+        return &a->static_elems[i];
+    else
+        return dynamic_index(a, i - a->static_length);
+}
+
+// Note: None of the removal functions call pcopy or any destructors, for the
+// same reasons as in array.c.
+
+Value remove_last(SegmentedArray* a)
+{
+    // FASTPATH
+    if(a->dynamic_length == 0)
+        return a->static_elems[--a->static_length];
+
+    Value ret = *dynamic_index(a, --a->dynamic_length);
+
+    // Like array.c, everything goes once the dynamic half is empty. Otherwise,
+    // one empty chunk is kept around past the end, so that pushing and popping
+    // across a chunk boundary doesn't thrash the allocator.
+    if(a->dynamic_length == 0)
+    {
+        while(a->chunk_count > 0)
+            pop_chunk(a);
+    }
+    else if(a->chunk_count >= 2
+         && a->dynamic_length <= chunk_start(a->chunk_count - 2))
+    {
+        pop_chunk(a);
+    }
+
+    return ret;
+}
+
+// Removes an element from the array without preserving the order of the
+// elements. Note that this moves the last element into slot `i', so pointers
+// to the last element are invalidated.
+Value unordered_remove(SegmentedArray* a, size_t i)
+{
+    swap(index(a, i), index(a, length(a) - 1));
+    return remove_last(a);
+}
@@ -0,0 +1,227 @@
+// serialize.c: Defines the binary format for saving and loading Arrays.
+//
+// An Array is written as a fixed 64-byte header followed by its elements,
+// static half then dynamic half, as one contiguous payload:
+//
+//   offset  size  field
+//        0     8  magic, "NLARRAY\0"
+//        8     4  format version, SERIALIZE_VERSION
+//       12     4  byte order mark, 0x01020304 as written by the saver
+//       16     8  sizeof(Value)
+//       24     8  number of elements
+//       32    32  reserved, zero
+//       64     -  the elements, length * sizeof(Value) bytes
+//
+// The elements are stored exactly as they are in memory, so loading is
+// zero-copy: load() points the Array's dynamic half straight into the buffer
+// (see "borrowed" in array.c), and only the first static_capacity elements
+// are copied, into the static half. Nothing is decoded per element.
+//
+// That only works for plain old data. Value MUST NOT hold pointers or
+// handles, and the loader must have the same Value layout and byte order as
+// the saver; both are checked, and a mismatch fails the load rather than
+// byte-swapping. Bump SERIALIZE_VERSION whenever the layout changes.
+//
+// The header is 64 bytes so that, in a page-aligned buffer such as one from
+// mmap, the payload starts on a cache line. The borrowed dynamic half starts
+// static_capacity elements further on, though, which is generally not on an
+// ARRAY_ALIGNMENT boundary. In aligned mode, load() copies the dynamic half
+// out whenever it would be misaligned, so aligned mode's guarantee still
+// holds, at the cost of the zero-copy load. Likewise, in any mode, a buffer
+// that isn't even aligned for a Value is copied out rather than borrowed.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SERIALIZE_VERSION       1
+#define SERIALIZE_BYTE_ORDER    0x01020304u
+#define SERIALIZE_HEADER_SIZE   64
+
+static const char SERIALIZE_MAGIC[8] = "NLARRAY";
+
+struct SerializeHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t value_size;
+    uint64_t length;
+    uint64_t reserved[4];
+};
+
+_Static_assert(sizeof(SerializeHeader) == SERIALIZE_HEADER_SIZE,
+               "SerializeHeader must be exactly SERIALIZE_HEADER_SIZE bytes");
+
+static SerializeHeader make_header(Array* a)
+{
+    SerializeHeader h;
+    memset(&h, 0, sizeof(h));
+
+    memcpy(h.magic, SERIALIZE_MAGIC, sizeof(h.magic));
+    h.version = SERIALIZE_VERSION;
+    h.byte_order = SERIALIZE_BYTE_ORDER;
+    h.value_size = sizeof(Value);
+    h.length = length(a);
+    return h;
+}
+
+// The number of bytes serialize() writes for `a'.
+size_t serialized_size(Array* a)
+{
+    return SERIALIZE_HEADER_SIZE + length(a) * sizeof(Value);
+}
+
+// Writes `a' into `out', which MUST have room for serialized_size(a) bytes.
+void serialize(Array* a, void* out)
+{
+    SerializeHeader h = make_header(a);
+    char* p = out;
+
+    memcpy(p, &h, sizeof(h));
+    p += sizeof(h);
+
+    memcpy(p, a->static_elems, a->static_length * sizeof(Value));
+    p += a->static_length * sizeof(Value);
+
+    memcpy(p, a->dynamic_elems, a->dynamic_length * sizeof(Value));
+}
+
+// Writes `a' to the file descriptor `fd'. The header and both halves go out
+// in one writev, without being gathered into a buffer first. Returns false
+// (with errno set) on a write error.
+bool serialize(Array* a, int fd)
+{
+    SerializeHeader h = make_header(a);
+
+    struct iovec iov[3] = {
+        { &h, sizeof(h) },
+        { a->static_elems, a->static_length * sizeof(Value) },
+        { a->dynamic_elems, a->dynamic_length * sizeof(Value) },
+    };
+    struct iovec* next = iov;
+    int count = 3;
+
+    // writev may write less than everything; pick up where it left off.
+    while(count > 0)
+    {
+        ssize_t n = writev(fd, next, count);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while(count > 0 && (size_t)n >= next->iov_len)
+        {
+            n -= (ssize_t)next->iov_len;
+            ++next;
+            --count;
+        }
+
+        if(count > 0)
+        {
+            next->iov_base = (char*)next->iov_base + n;
+            next->iov_len -= (size_t)n;
+        }
+    }
+
+    return true;
+}
+
+// Checks that the `size' bytes at `buf' start with a header this build can
+// load, and if so, sets `length' to the number of elements that follow it.
+bool check_header(const void* buf, size_t size, size_t* length)
+{
+    if(size < SERIALIZE_HEADER_SIZE)
+        return false;
+
+    SerializeHeader h;
+    memcpy(&h, buf, sizeof(h));
+
+    if(memcmp(h.magic, SERIALIZE_MAGIC, sizeof(h.magic)) != 0
+    || h.version != SERIALIZE_VERSION
+    || h.byte_order != SERIALIZE_BYTE_ORDER
+    || h.value_size != sizeof(Value)
+    || h.length > SIZE_MAX / sizeof(Value))
+        return false;
+
+    *length = (size_t)h.length;
+    return true;
+}
+
+// Loads the Array serialized in the `size' bytes at `buf' into `a', which
+// MUST be empty. Returns false, leaving `a' empty, if the buffer isn't a
+// valid serialized Array for this build.
+//
+// The dynamic half borrows `buf', so `buf' MUST outlive `a' or at least its
+// dynamic half: the Array copies out of it as soon as it grows or shrinks.
+// A buffer received from elsewhere may start at any offset, though, and a
+// dynamic half which would be misaligned for a Value (or, in aligned mode,
+// for ARRAY_ALIGNMENT) is copied out instead of borrowed.
+bool load(Array* a, const void* buf, size_t size)
+{
+    assert(length(a) == 0);
+
+    size_t n;
+    if(!check_header(buf, size, &n))
+        return false;
+
+    if(n > (size - SERIALIZE_HEADER_SIZE) / sizeof(Value))
+        return false;
+
+    // Not a Value*: until it has been checked, it may be misaligned.
+    const char* elems = (const char*)buf + SERIALIZE_HEADER_SIZE;
+
+    // The static half is filled first, as always; the rest is borrowed.
+    size_t s = n < a->static_capacity ? n : a->static_capacity;
+    memcpy(a->static_elems, elems, s * sizeof(Value));
+    a->static_length = s;
+
+    // An empty Array may still hold an allocation.
+    if(a->dynamic_capacity)
+        free(a->dynamic_elems);
+    a->dynamic_elems = NULL;
+    a->dynamic_length = 0;
+    a->dynamic_capacity = 0;
+
+    if(n > s)
+    {
+        const char* rest = elems + s * sizeof(Value);
+        size_t bytes = (n - s) * sizeof(Value);
+
+#ifdef ARRAY_ALIGNMENT
+        if((uintptr_t)rest % ARRAY_ALIGNMENT != 0)
+        {
+            // aligned_alloc requires the size to be a multiple of the
+            // alignment.
+            size_t rounded = (bytes + ARRAY_ALIGNMENT - 1)
+                           & ~(size_t)(ARRAY_ALIGNMENT - 1);
+
+            // BUG: No OOM checking.
+            a->dynamic_elems = aligned_alloc(ARRAY_ALIGNMENT, rounded);
+            memcpy(a->dynamic_elems, rest, bytes);
+            a->dynamic_capacity = n - s;
+        }
+#else
+        if((uintptr_t)rest % _Alignof(Value) != 0)
+        {
+            // BUG: No OOM checking.
+            a->dynamic_elems = malloc(bytes);
+            memcpy(a->dynamic_elems, rest, bytes);
+            a->dynamic_capacity = n - s;
+        }
+#endif
+        else
+        {
+            a->dynamic_elems = (Value*)rest;
+        }
+
+        a->dynamic_length = n - s;
+    }
+
+    return true;
+}
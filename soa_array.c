@@ -0,0 +1,281 @@
+// soa_array.c: Defines NewLang's structure-of-arrays array type.
+//
+// An Array of a POD type stores whole records one after another, so a scan
+// over a single field drags every other field of every record through the
+// cache with it. A SoaArray instead stores one column per field: all of the
+// records' first fields together, then all of their second fields, and so on.
+// A scan over one field then touches only that field's bytes, and each column
+// is a plain contiguous run that the compiler can vectorize over.
+//
+// Otherwise, it is laid out exactly like an Array (see array.c). The static
+// half is allocated inline, and holds static_capacity records, column after
+// column. The dynamic half is one heap block holding dynamic_capacity
+// records, again column after column, and is only created on overflow.
+//
+// The record type is described at runtime by a SoaLayout, which the compiler
+// would generate from the `type' declaration:
+//
+//   type Point
+//       float x          # SoaLayout { 3, { 8, 8, 4 }, { 0, 8, 16 } }
+//       float y
+//       uint32 id
+#include <stddef.h>
+#include <stdbool.h>
+
+// The minimum size of the dynamic half after the initial allocation.
+// This should always be a power of two for performance reasons.
+#define SOA_DYNAMIC_SIZE_MIN    16
+
+// The most fields a record may have.
+#define SOA_FIELDS_MAX          16
+
+struct SoaLayout
+{
+    size_t field_count;
+    // The size of each field.
+    size_t sizes[SOA_FIELDS_MAX];
+    // The offset of each field within a record.
+    size_t offsets[SOA_FIELDS_MAX];
+};
+
+struct SoaArray
+{
+    const SoaLayout* layout;
+
+    size_t dynamic_length;
+    size_t dynamic_capacity;
+    unsigned char* dynamic_columns;
+
+    size_t static_length;
+    size_t static_capacity;
+    // Aligned for the widest field type, so every column starts aligned as
+    // long as the fields are laid out widest first.
+    _Alignas(max_align_t) unsigned char static_columns[];
+};
+
+// A contiguous run of one field's values.
+struct ColumnSpan
+{
+    void* elems;
+    size_t length;
+};
+
+// The byte offset of field `f''s column within a block of `capacity' records.
+static size_t column_offset(const SoaLayout* l, size_t f, size_t capacity)
+{
+    size_t offset = 0;
+    for(size_t g = 0; g < f; ++g)
+        offset += l->sizes[g] * capacity;
+    return offset;
+}
+
+static size_t record_size(const SoaLayout* l)
+{
+    return column_offset(l, l->field_count, 1);
+}
+
+static unsigned char* field_ptr(unsigned char* block, const SoaLayout* l,
+                                size_t capacity, size_t f, size_t i)
+{
+    return block + column_offset(l, f, capacity) + i * l->sizes[f];
+}
+
+static void resize_dynamic(SoaArray* a, size_t newcap)
+{
+    assert(a->dynamic_length <= newcap);
+
+    const SoaLayout* l = a->layout;
+
+    // Every column moves, since they are all spaced by the capacity.
+    unsigned char* new_mem = NULL;
+    if(newcap != 0)
+    {
+        // BUG: No OOM checking.
+        new_mem = malloc(newcap * record_size(l));
+
+        for(size_t f = 0; f < l->field_count; ++f)
+        {
+            memcpy(field_ptr(new_mem, l, newcap, f, 0),
+                   field_ptr(a->dynamic_columns, l, a->dynamic_capacity, f, 0),
+                   a->dynamic_length * l->sizes[f]);
+        }
+    }
+
+    free(a->dynamic_columns);
+    a->dynamic_columns = new_mem;
+    a->dynamic_capacity = newcap;
+}
+
+size_t length(SoaArray* a)
+{
+    return a->static_length + a->dynamic_length;
+}
+
+void reserve(SoaArray* a, size_t capacity)
+{
+    if(capacity <= length(a))
+        return;
+
+    if(capacity <= a->static_capacity)
+        return;
+
+    resize_dynamic(a, capacity - a->static_capacity);
+}
+
+// `a' MUST be allocated in the parent function with a stub like Array's,
+// where each requested record takes record_size(layout) bytes and the header
+// is offsetof(SoaArray, static_columns) bytes.
+void init(SoaArray* a, const SoaLayout* layout)
+{
+    assert(layout->field_count <= SOA_FIELDS_MAX);
+
+    a->layout = layout;
+
+    a->dynamic_length = 0;
+    a->dynamic_capacity = 0;
+    a->dynamic_columns = NULL;
+
+    a->static_length = 0;
+    // a->static_capacity was set in assembly.
+    // a->static_columns can be left undefined.
+}
+
+// Records are POD, so there is nothing to destroy or pcopy field by field.
+void destroy(SoaArray* a)
+{
+    if(a->dynamic_columns)
+        free(a->dynamic_columns);
+}
+
+void pcopy(SoaArray* a)
+{
+    if(a->dynamic_columns)
+    {
+        // BUG: No OOM checking.
+        size_t dynamic_bytes = a->dynamic_capacity * record_size(a->layout);
+        unsigned char* new_mem = malloc(dynamic_bytes);
+        memcpy(new_mem, a->dynamic_columns, dynamic_bytes);
+        a->dynamic_columns = new_mem;
+    }
+}
+
+// Scatters the fields of `record' into the end of each column.
+void append(SoaArray* a, const void* record)
+{
+    const SoaLayout* l = a->layout;
+    const unsigned char* src = record;
+
+    unsigned char* block;
+    size_t capacity;
+    size_t i;
+
+    if(a->static_length < a->static_capacity)
+    {
+        block = a->static_columns;
+        capacity = a->static_capacity;
+        i = a->static_length++;
+    }
+    else
+    {
+        if(a->dynamic_length == a->dynamic_capacity)
+        {
+            if(a->dynamic_capacity == 0)
+                resize_dynamic(a, SOA_DYNAMIC_SIZE_MIN);
+            else
+                resize_dynamic(a, a->dynamic_capacity * 2);
+        }
+
+        block = a->dynamic_columns;
+        capacity = a->dynamic_capacity;
+        i = a->dynamic_length++;
+    }
+
+    for(size_t f = 0; f < l->field_count; ++f)
+        memcpy(field_ptr(block, l, capacity, f, i), src + l->offsets[f],
+               l->sizes[f]);
+}
+
+// Gathers record `i' back together into `record'.
+void get(SoaArray* a, size_t i, void* record)
+{
+    assert(i < length(a));
+
+    const SoaLayout* l = a->layout;
+    unsigned char* dst = record;
+
+    unsigned char* block = a->static_columns;
+    size_t capacity = a->static_capacity;
+    if(i >= a->static_length)
+    {
+        block = a->dynamic_columns;
+        capacity = a->dynamic_capacity;
+        i -= a->static_length;
+    }
+
+    for(size_t f = 0; f < l->field_count; ++f)
+        memcpy(dst + l->offsets[f], field_ptr(block, l, capacity, f, i),
+               l->sizes[f]);
+}
+
+// Returns a pointer to field `f' of record `i'.
+void* field(SoaArray* a, size_t i, size_t f)
+{
+    assert(i < length(a));
+    assert(f < a->layout->field_count);
+
+    if(i < a->static_length)
+        return field_ptr(a->static_columns, a->layout, a->static_capacity, f, i);
+    else
+        return field_ptr(a->dynamic_columns, a->layout, a->dynamic_capacity,
+                         f, i - a->static_length);
+}
+
+// Fills `out' with the two contiguous runs making up field `f''s column: the
+// part in the static half, then the part in the dynamic half. Either may be
+// empty. A scan over one field is then two tight loops:
+//
+//   ColumnSpan s[2]
+//   column(a, X, s)
+//   for(size_t h = 0; h < 2; ++h)
+//       float$ x = s[h].elems
+//       for(size_t i = 0; i < s[h].length; ++i)
+//           sum += x[i]
+void column(SoaArray* a, size_t f, ColumnSpan out[2])
+{
+    assert(f < a->layout->field_count);
+
+    out[0].elems = field_ptr(a->static_columns, a->layout, a->static_capacity,
+                             f, 0);
+    out[0].length = a->static_length;
+
+    out[1].elems = a->dynamic_columns
+                 ? field_ptr(a->dynamic_columns, a->layout,
+                             a->dynamic_capacity, f, 0)
+                 : NULL;
+    out[1].length = a->dynamic_length;
+}
+
+// Note: As in array.c, remove_last does not run any destructors. Records are
+// POD, so there are none to run anyway.
+void remove_last(SoaArray* a, void* record)
+{
+    get(a, length(a) - 1, record);
+
+    if(a->dynamic_length == 0)
+    {
+        --a->static_length;
+        return;
+    }
+
+    --a->dynamic_length;
+
+    if(a->dynamic_length == 0)
+    {
+        resize_dynamic(a, 0);
+    }
+    else if(a->dynamic_length <= a->dynamic_capacity >> 2
+         && a->dynamic_length >= SOA_DYNAMIC_SIZE_MIN)
+    {
+        resize_dynamic(a, a->dynamic_capacity >> 1);
+    }
+}
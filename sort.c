@@ -0,0 +1,426 @@
+// sort.c: Sorting for NewLang's array type.
+//
+// An Array's elements are split between its static and dynamic halves (see
+// array.c), so it can't just be handed to qsort. Everything here sorts both
+// halves in place, as one sequence, without first gathering them into a
+// single buffer:
+//
+//   sort        - Introsort: quicksort with a median-of-three pivot, falling
+//                 back to heapsort if the recursion gets too deep, and to
+//                 insertion sort for short ranges. O(n log n) worst case, not
+//                 stable. Always single-threaded.
+//   radix_sort  - LSD radix sort on 64-bit integer keys. O(n), stable, and
+//                 needs O(n) scratch. int_key and float_key map signed and
+//                 floating point keys onto order-preserving unsigned ones.
+//   parallel_sort
+//               - Merge sort across threads. Each thread introsorts one run,
+//                 then runs are merged pairwise, in parallel, until one is
+//                 left. Stable across runs, but not within them. Opt-in
+//                 only, since `less' is called from several threads at once
+//                 and O(n) scratch is allocated.
+//
+// Comparators follow the same convention as foreach: a function pointer plus
+// an `aux' pointer which is passed through untouched.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Ranges at most this long are insertion sorted.
+#define INSERTION_SORT_MAX  16
+
+// parallel_sort falls back to sort below this length, where starting the
+// threads would cost more than they save.
+#define PARALLEL_SORT_MIN   (1 << 16)
+
+// The most threads parallel_sort will use. This MUST be a power of two.
+#define SORT_THREADS_MAX    64
+
+// The number of one-byte digits in a radix sort key.
+#define RADIX_DIGITS        8
+
+typedef bool (*Less)(const Value*, const Value*, void*);
+
+// Both halves of an array, viewed as one sequence. at() compiles to a compare
+// and a conditional move, so there is no branch to mispredict.
+struct Halves
+{
+    Value* lo;
+    size_t lo_length;
+    Value* hi;
+};
+
+static Halves halves(Array* a)
+{
+    Halves h = { a->static_elems, a->static_length, a->dynamic_elems };
+    return h;
+}
+
+static Value* at(const Halves* h, size_t i)
+{
+    return i < h->lo_length ? h->lo + i : h->hi + (i - h->lo_length);
+}
+
+static void insertion_sort(const Halves* h, size_t lo, size_t hi,
+                           Less less, void* aux)
+{
+    for(size_t i = lo + 1; i < hi; ++i)
+    {
+        Value v = *at(h, i);
+
+        size_t j = i;
+        for(; j > lo && less(&v, at(h, j - 1), aux); --j)
+            *at(h, j) = *at(h, j - 1);
+
+        *at(h, j) = v;
+    }
+}
+
+static void sift_down(const Halves* h, size_t lo, size_t n, size_t root,
+                      Less less, void* aux)
+{
+    for(;;)
+    {
+        size_t child = 2 * root + 1;
+        if(child >= n)
+            return;
+
+        if(child + 1 < n && less(at(h, lo + child), at(h, lo + child + 1), aux))
+            ++child;
+
+        if(!less(at(h, lo + root), at(h, lo + child), aux))
+            return;
+
+        swap(at(h, lo + root), at(h, lo + child));
+        root = child;
+    }
+}
+
+static void heap_sort(const Halves* h, size_t lo, size_t hi,
+                      Less less, void* aux)
+{
+    size_t n = hi - lo;
+
+    for(size_t i = n / 2; i-- > 0; )
+        sift_down(h, lo, n, i, less, aux);
+
+    for(size_t end = n; end-- > 1; )
+    {
+        swap(at(h, lo), at(h, lo + end));
+        sift_down(h, lo, end, 0, less, aux);
+    }
+}
+
+// Partitions [lo, hi) around the median of its first, middle and last
+// elements, and returns the pivot's final position. Sorting the three
+// candidates leaves the largest at hi - 1, which stops the left-to-right
+// scan without a bounds check.
+static size_t partition(const Halves* h, size_t lo, size_t hi,
+                        Less less, void* aux)
+{
+    size_t mid = lo + (hi - lo) / 2;
+
+    if(less(at(h, mid), at(h, lo), aux))
+        swap(at(h, mid), at(h, lo));
+    if(less(at(h, hi - 1), at(h, mid), aux))
+    {
+        swap(at(h, hi - 1), at(h, mid));
+        if(less(at(h, mid), at(h, lo), aux))
+            swap(at(h, mid), at(h, lo));
+    }
+
+    swap(at(h, lo), at(h, mid));
+    Value pivot = *at(h, lo);
+
+    size_t i = lo;
+    size_t j = hi;
+    for(;;)
+    {
+        do ++i; while(less(at(h, i), &pivot, aux));
+        do --j; while(less(&pivot, at(h, j), aux));
+
+        if(i >= j)
+            break;
+
+        swap(at(h, i), at(h, j));
+    }
+
+    swap(at(h, lo), at(h, j));
+    return j;
+}
+
+static void introsort(const Halves* h, size_t lo, size_t hi, size_t depth,
+                      Less less, void* aux)
+{
+    while(hi - lo > INSERTION_SORT_MAX)
+    {
+        if(depth == 0)
+        {
+            heap_sort(h, lo, hi, less, aux);
+            return;
+        }
+        --depth;
+
+        size_t p = partition(h, lo, hi, less, aux);
+
+        // Recurse into the smaller side and loop on the larger, so the stack
+        // never gets deeper than log2(n).
+        if(p - lo < hi - p - 1)
+        {
+            introsort(h, lo, p, depth, less, aux);
+            lo = p + 1;
+        }
+        else
+        {
+            introsort(h, p + 1, hi, depth, less, aux);
+            hi = p;
+        }
+    }
+
+    insertion_sort(h, lo, hi, less, aux);
+}
+
+static size_t depth_limit(size_t n)
+{
+    size_t log2 = 0;
+    while(n >>= 1)
+        ++log2;
+    return 2 * log2;
+}
+
+struct SortTask
+{
+    Value* src;
+    Value* dst;
+    size_t lo;
+    size_t mid;
+    size_t hi;
+    Less less;
+    void* aux;
+};
+
+static void* sort_task(void* p)
+{
+    SortTask* t = p;
+
+    Halves h = { t->src + t->lo, t->hi - t->lo, NULL };
+    introsort(&h, 0, t->hi - t->lo, depth_limit(t->hi - t->lo), t->less, t->aux);
+    return NULL;
+}
+
+// Merges src[lo, mid) and src[mid, hi) into dst[lo, hi). Ties go to the left
+// run, which keeps the merge stable.
+static void* merge_task(void* p)
+{
+    SortTask* t = p;
+
+    size_t i = t->lo;
+    size_t j = t->mid;
+    size_t k = t->lo;
+
+    while(i < t->mid && j < t->hi)
+    {
+        if(t->less(&t->src[j], &t->src[i], t->aux))
+            t->dst[k++] = t->src[j++];
+        else
+            t->dst[k++] = t->src[i++];
+    }
+
+    memcpy(t->dst + k, t->src + i, (t->mid - i) * sizeof(Value));
+    k += t->mid - i;
+    memcpy(t->dst + k, t->src + j, (t->hi - j) * sizeof(Value));
+    return NULL;
+}
+
+// The number of threads to sort with: the largest power of two no greater
+// than the number of online CPUs.
+static size_t sort_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // sysconf reports failure as -1, which would otherwise be cast to
+    // SIZE_MAX and ask for SORT_THREADS_MAX threads.
+    if(cpus < 1)
+        return 1;
+
+    size_t threads = 1;
+    while(threads * 2 <= (size_t)cpus && threads * 2 <= SORT_THREADS_MAX)
+        threads *= 2;
+    return threads;
+}
+
+// Runs `count' tasks, one per thread, and waits for all of them.
+static void run_tasks(void* (*f)(void*), SortTask* tasks, size_t count)
+{
+    pthread_t threads[SORT_THREADS_MAX];
+
+    // BUG: No checking for failure to spawn a thread.
+    for(size_t t = 1; t < count; ++t)
+        pthread_create(&threads[t], NULL, f, &tasks[t]);
+
+    // The calling thread takes a share of the work, rather than idling.
+    f(&tasks[0]);
+
+    for(size_t t = 1; t < count; ++t)
+        pthread_join(threads[t], NULL);
+}
+
+// Like sort, but spread across up to one thread per CPU. `less' is called
+// from several threads at once, with the same `aux', so both MUST be safe to
+// use concurrently; sort never does this, which is why it is never chosen
+// automatically. Arrays shorter than PARALLEL_SORT_MIN are just sorted.
+//
+// Unlike the other sorts, this gathers the array into one contiguous buffer
+// first: the threads need contiguous runs to merge between, and at these
+// sizes the two copies (2n elements of scratch) are cheap next to the sort
+// itself.
+void parallel_sort(Array* a, Less less, void* aux)
+{
+    size_t n = length(a);
+    size_t threads = sort_threads();
+
+    if(n < PARALLEL_SORT_MIN || threads == 1)
+    {
+        sort(a, less, aux);
+        return;
+    }
+
+    // BUG: No OOM checking.
+    Value* src = malloc(n * sizeof(Value));
+    Value* dst = malloc(n * sizeof(Value));
+
+    memcpy(src, a->static_elems, a->static_length * sizeof(Value));
+    memcpy(src + a->static_length, a->dynamic_elems,
+           a->dynamic_length * sizeof(Value));
+
+    size_t bounds[SORT_THREADS_MAX + 1];
+    for(size_t t = 0; t <= threads; ++t)
+        bounds[t] = n * t / threads;
+
+    SortTask tasks[SORT_THREADS_MAX];
+    for(size_t t = 0; t < threads; ++t)
+    {
+        SortTask task = { src, NULL, bounds[t], 0, bounds[t + 1], less, aux };
+        tasks[t] = task;
+    }
+    run_tasks(sort_task, tasks, threads);
+
+    // Merge runs pairwise, halving the number of runs (and of threads) each
+    // round.
+    for(size_t width = 1; width < threads; width *= 2)
+    {
+        size_t count = 0;
+        for(size_t t = 0; t < threads; t += 2 * width)
+        {
+            SortTask task = { src, dst, bounds[t], bounds[t + width],
+                              bounds[t + 2 * width], less, aux };
+            tasks[count++] = task;
+        }
+        run_tasks(merge_task, tasks, count);
+
+        Value* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    memcpy(a->static_elems, src, a->static_length * sizeof(Value));
+    memcpy(a->dynamic_elems, src + a->static_length,
+           a->dynamic_length * sizeof(Value));
+
+    free(src);
+    free(dst);
+}
+
+// Sorts the array in place, so that less(index(a, i + 1), index(a, i)) is
+// false for every i. Runs entirely on the calling thread, and allocates
+// nothing.
+void sort(Array* a, Less less, void* aux)
+{
+    size_t n = length(a);
+
+    Halves h = halves(a);
+    introsort(&h, 0, n, depth_limit(n), less, aux);
+}
+
+// Maps a signed integer onto an unsigned one with the same ordering.
+uint64_t int_key(int64_t i)
+{
+    return (uint64_t)i ^ ((uint64_t)1 << 63);
+}
+
+// Maps a float onto an unsigned integer with the same ordering. Positive
+// floats just need their sign bit set; negative ones need every bit flipped,
+// since their magnitude grows the wrong way. NaNs sort to the ends.
+uint64_t float_key(double f)
+{
+    uint64_t u;
+    memcpy(&u, &f, sizeof(u));
+
+    return (u >> 63) ? ~u : u | ((uint64_t)1 << 63);
+}
+
+struct Keyed
+{
+    uint64_t key;
+    Value val;
+};
+
+// Sorts the array in place by `key', one byte of the key at a time, least
+// significant first. Each key is computed exactly once. Passes over a byte
+// which is the same in every key are skipped, so narrow keys (a uint16 stored
+// in a uint64) only pay for the bytes they use.
+void radix_sort(Array* a, uint64_t (*key)(const Value*))
+{
+    size_t n = length(a);
+    if(n < 2)
+        return;
+
+    // BUG: No OOM checking.
+    Keyed* src = malloc(n * sizeof(Keyed));
+    Keyed* dst = malloc(n * sizeof(Keyed));
+
+    // One read of the array builds the histograms for every pass.
+    size_t counts[RADIX_DIGITS][256] = { { 0 } };
+
+    Halves h = halves(a);
+    for(size_t i = 0; i < n; ++i)
+    {
+        src[i].val = *at(&h, i);
+        src[i].key = key(&src[i].val);
+
+        for(size_t d = 0; d < RADIX_DIGITS; ++d)
+            ++counts[d][(src[i].key >> (8 * d)) & 0xFF];
+    }
+
+    for(size_t d = 0; d < RADIX_DIGITS; ++d)
+    {
+        size_t shift = 8 * d;
+
+        if(counts[d][(src[0].key >> shift) & 0xFF] == n)
+            continue;
+
+        size_t offsets[256];
+        size_t sum = 0;
+        for(size_t b = 0; b < 256; ++b)
+        {
+            offsets[b] = sum;
+            sum += counts[d][b];
+        }
+
+        for(size_t i = 0; i < n; ++i)
+            dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+        Keyed* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    for(size_t i = 0; i < a->static_length; ++i)
+        a->static_elems[i] = src[i].val;
+    for(size_t i = 0; i < a->dynamic_length; ++i)
+        a->dynamic_elems[i] = src[a->static_length + i].val;
+
+    free(src);
+    free(dst);
+}
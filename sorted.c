@@ -0,0 +1,388 @@
+// sorted.c: Operations on sorted arrays.
+//
+// Every function here assumes its arrays have already been sorted with the
+// same `less' (see sort.c), and that `less' is a strict weak order.
+//
+//   lower_bound, upper_bound
+//       - Binary search. The loop runs exactly log2(n) times, and the only
+//         thing depending on each comparison is a conditional move, so there
+//         are no branches to mispredict. Only the first step, which picks
+//         the static or dynamic half, is a real branch.
+//   Eytzinger
+//       - A copy of a sorted array in breadth-first (Eytzinger) order, for
+//         lookup-heavy indexes. The first levels of the search all share a
+//         few cache lines, and since the next several levels of a search are
+//         contiguous, they can be prefetched before they are needed.
+//   merge, intersect, unite
+//       - Linear-time merge and set operations into an output array. When one
+//         input is much smaller than the other, intersect gallops through the
+//         larger one instead of walking it.
+//   intersect_u32
+//       - A SIMD kernel for the common case of intersecting runs of 32-bit
+//         ids, comparing four against four at a time.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// intersect gallops when one input is at least this many times longer than
+// the other.
+#define GALLOP_RATIO        32
+
+// How many levels ahead the Eytzinger search prefetches. Four levels of
+// 8-byte elements is 16 elements: two cache lines, and so two prefetches.
+#define EYTZINGER_PREFETCH  4
+
+#define CACHE_LINE          64
+
+typedef bool (*Less)(const Value*, const Value*, void*);
+
+// Returns the position of the first element of `base[0, n)' that is not less
+// than `key', or `n' if there is none.
+static size_t span_lower_bound(const Value* base, size_t n, const Value* key,
+                               Less less, void* aux)
+{
+    if(n == 0)
+        return 0;
+
+    const Value* first = base;
+    while(n > 1)
+    {
+        size_t half = n / 2;
+        first = less(&first[half], key, aux) ? first + half : first;
+        n -= half;
+    }
+
+    return (size_t)(first - base) + less(first, key, aux);
+}
+
+// Returns the position of the first element of `base[0, n)' that is greater
+// than `key', or `n' if there is none.
+static size_t span_upper_bound(const Value* base, size_t n, const Value* key,
+                               Less less, void* aux)
+{
+    if(n == 0)
+        return 0;
+
+    const Value* first = base;
+    while(n > 1)
+    {
+        size_t half = n / 2;
+        first = less(key, &first[half], aux) ? first : first + half;
+        n -= half;
+    }
+
+    return (size_t)(first - base) + !less(key, first, aux);
+}
+
+// Returns the index of the first element not less than `key', or length(a).
+size_t lower_bound(Array* a, const Value* key, Less less, void* aux)
+{
+    // The key belongs in the dynamic half iff the last static element is
+    // less than it.
+    if(a->dynamic_length != 0
+    && (a->static_length == 0
+     || less(&a->static_elems[a->static_length - 1], key, aux)))
+    {
+        return a->static_length
+             + span_lower_bound(a->dynamic_elems, a->dynamic_length, key,
+                                less, aux);
+    }
+
+    return span_lower_bound(a->static_elems, a->static_length, key, less, aux);
+}
+
+// Returns the index of the first element greater than `key', or length(a).
+size_t upper_bound(Array* a, const Value* key, Less less, void* aux)
+{
+    if(a->dynamic_length != 0
+    && (a->static_length == 0
+     || !less(key, &a->static_elems[a->static_length - 1], aux)))
+    {
+        return a->static_length
+             + span_upper_bound(a->dynamic_elems, a->dynamic_length, key,
+                                less, aux);
+    }
+
+    return span_upper_bound(a->static_elems, a->static_length, key, less, aux);
+}
+
+struct Eytzinger
+{
+    size_t length;
+    // 1-based: elems[0] is unused, and the children of elems[k] are
+    // elems[2k] and elems[2k + 1].
+    Value* elems;
+};
+
+// Fills the subtree rooted at `k' with the sorted elements starting at `i'
+// (an in-order traversal), and returns the index after the last one used.
+static size_t eytzinger_fill(Eytzinger* e, Array* sorted, size_t i, size_t k)
+{
+    if(k <= e->length)
+    {
+        i = eytzinger_fill(e, sorted, i, 2 * k);
+        e->elems[k] = *index_unchecked(sorted, i++);
+        i = eytzinger_fill(e, sorted, i, 2 * k + 1);
+    }
+    return i;
+}
+
+void init(Eytzinger* e, Array* sorted)
+{
+    e->length = length(sorted);
+
+    // elems[0] goes on a cache line boundary, so that each block of
+    // descendants lower_bound prefetches (which starts at a multiple of
+    // 2^EYTZINGER_PREFETCH) starts on one too, and spans as few lines as
+    // possible. aligned_alloc requires the size to be a multiple of the
+    // alignment.
+    size_t bytes = (e->length + 1) * sizeof(Value);
+    bytes = (bytes + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+
+    // BUG: No OOM checking.
+    e->elems = aligned_alloc(CACHE_LINE, bytes);
+    eytzinger_fill(e, sorted, 0, 1);
+}
+
+void destroy(Eytzinger* e)
+{
+    free(e->elems);
+}
+
+// Returns the first element not less than `key', or NULL if there is none.
+Value* lower_bound(Eytzinger* e, const Value* key, Less less, void* aux)
+{
+    size_t k = 1;
+    while(k <= e->length)
+    {
+        // The 2^EYTZINGER_PREFETCH descendants of `k' this many levels down
+        // are contiguous, so prefetching every line they span covers
+        // whichever way we go. The loop has a constant trip count, and
+        // unrolls to one prefetch per line.
+        const char* block =
+            (const char*)(e->elems + (k << EYTZINGER_PREFETCH));
+        for(size_t b = 0; b < sizeof(Value) << EYTZINGER_PREFETCH;
+            b += CACHE_LINE)
+        {
+            __builtin_prefetch(block + b);
+        }
+
+        k = 2 * k + less(&e->elems[k], key, aux);
+    }
+
+    // `k' went right (1) after every element less than the key, and left (0)
+    // at the answer. Undo the trailing rights, then the final left.
+    k >>= __builtin_ffsl((long)~k);
+
+    return k == 0 ? NULL : &e->elems[k];
+}
+
+// Appends the elements of `x' and `y' to `out', in sorted order. Ties are
+// taken from `x' first, so the merge is stable.
+void merge(Array* out, Array* x, Array* y, Less less, void* aux)
+{
+    size_t nx = length(x);
+    size_t ny = length(y);
+    reserve(out, length(out) + nx + ny);
+
+    size_t i = 0;
+    size_t j = 0;
+    while(i < nx && j < ny)
+    {
+        Value* vx = index_unchecked(x, i);
+        Value* vy = index_unchecked(y, j);
+
+        if(less(vy, vx, aux))
+        {
+            append(out, vy);
+            ++j;
+        }
+        else
+        {
+            append(out, vx);
+            ++i;
+        }
+    }
+
+    for(; i < nx; ++i)
+        append(out, index_unchecked(x, i));
+    for(; j < ny; ++j)
+        append(out, index_unchecked(y, j));
+}
+
+// Returns the index of the first element of `a' at or after `from' that is
+// not less than `key'. Probes at from+1, from+3, from+7, ... until it
+// overshoots, then binary searches the last gap, so a match `d' elements
+// away costs O(log d) rather than O(d).
+static size_t gallop(Array* a, size_t from, const Value* key,
+                     Less less, void* aux)
+{
+    size_t n = length(a);
+    size_t lo = from;
+    size_t step = 1;
+
+    while(lo + step < n && less(index_unchecked(a, lo + step), key, aux))
+    {
+        lo += step;
+        step *= 2;
+    }
+
+    size_t hi = lo + step < n ? lo + step : n;
+
+    // Now [lo, hi) brackets the answer. A plain binary search finishes.
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(less(index_unchecked(a, mid), key, aux))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Appends the elements which appear in both `x' and `y' to `out'.
+void intersect(Array* out, Array* x, Array* y, Less less, void* aux)
+{
+    // Always walk the smaller array.
+    if(length(x) > length(y))
+    {
+        Array* tmp = x;
+        x = y;
+        y = tmp;
+    }
+
+    size_t nx = length(x);
+    size_t ny = length(y);
+    bool skewed = nx * GALLOP_RATIO < ny;
+
+    size_t i = 0;
+    size_t j = 0;
+    while(i < nx && j < ny)
+    {
+        Value* vx = index_unchecked(x, i);
+
+        if(skewed)
+        {
+            j = gallop(y, j, vx, less, aux);
+            if(j == ny)
+                break;
+        }
+
+        Value* vy = index_unchecked(y, j);
+
+        if(less(vx, vy, aux))
+        {
+            ++i;
+        }
+        else if(less(vy, vx, aux))
+        {
+            ++j;
+        }
+        else
+        {
+            append(out, vx);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+// Appends the elements which appear in either `x' or `y' to `out'. Elements
+// appearing in both are appended once.
+void unite(Array* out, Array* x, Array* y, Less less, void* aux)
+{
+    size_t nx = length(x);
+    size_t ny = length(y);
+
+    size_t i = 0;
+    size_t j = 0;
+    while(i < nx && j < ny)
+    {
+        Value* vx = index_unchecked(x, i);
+        Value* vy = index_unchecked(y, j);
+
+        if(less(vx, vy, aux))
+        {
+            append(out, vx);
+            ++i;
+        }
+        else if(less(vy, vx, aux))
+        {
+            append(out, vy);
+            ++j;
+        }
+        else
+        {
+            append(out, vx);
+            ++i;
+            ++j;
+        }
+    }
+
+    for(; i < nx; ++i)
+        append(out, index_unchecked(x, i));
+    for(; j < ny; ++j)
+        append(out, index_unchecked(y, j));
+}
+
+// Writes the values which appear in both of the sorted, duplicate-free runs
+// `x' and `y' to `out', which must have room for the shorter of the two.
+// Returns the number written. Pass an array's static and dynamic halves as
+// separate runs.
+size_t intersect_u32(const uint32_t* x, size_t nx, const uint32_t* y,
+                     size_t ny, uint32_t* out)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t k = 0;
+
+#ifdef __SSE2__
+    // Compare a block of four from each side against each other: the four
+    // rotations of `vy' line every y up against every x once. Then advance
+    // whichever block has the smaller maximum (or both).
+    while(i + 4 <= nx && j + 4 <= ny)
+    {
+        __m128i vx = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i vy = _mm_loadu_si128((const __m128i*)(y + j));
+
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(vx, vy),
+                         _mm_cmpeq_epi32(vx, _mm_shuffle_epi32(vy, 0x39))),
+            _mm_or_si128(_mm_cmpeq_epi32(vx, _mm_shuffle_epi32(vy, 0x4E)),
+                         _mm_cmpeq_epi32(vx, _mm_shuffle_epi32(vy, 0x93))));
+
+        for(int hits = _mm_movemask_ps(_mm_castsi128_ps(eq)); hits;
+            hits &= hits - 1)
+        {
+            out[k++] = x[i + __builtin_ctz(hits)];
+        }
+
+        uint32_t xmax = x[i + 3];
+        uint32_t ymax = y[j + 3];
+        i += (xmax <= ymax) * 4;
+        j += (ymax <= xmax) * 4;
+    }
+#endif
+
+    // Scalar finish for whatever is left over.
+    while(i < nx && j < ny)
+    {
+        if(x[i] < y[j])
+            ++i;
+        else if(y[j] < x[i])
+            ++j;
+        else
+        {
+            out[k++] = x[i];
+            ++i;
+            ++j;
+        }
+    }
+
+    return k;
+}
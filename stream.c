@@ -0,0 +1,206 @@
+// stream.c: Defines NewLang's streaming Array writer and reader.
+//
+// Building a whole Array in memory just to write it out needs memory for the
+// whole dataset. A StreamWriter needs memory for one chunk: it is an Array
+// which, whenever it reaches chunk_length elements, writes them out to a
+// file descriptor and starts over, reusing the same dynamic half. A
+// StreamReader reads the result back a chunk at a time, into one buffer of
+// fixed size. Either way, a multi-gigabyte dataset streams through a few
+// megabytes of memory.
+//
+// A stream is a sequence of chunks, each in the format of serialize.c: a
+// header and a contiguous payload. A stream of one chunk is therefore also a
+// serialized Array, and can be load()ed directly. The last chunk may be
+// short, and the stream ends at end of file.
+//
+// Like serialize.c, this is only for plain-old-data Values. Elements are not
+// destroyed once written, since they have been handed off to the file.
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+// The chunk length used when none is given, in elements.
+#define STREAM_CHUNK_DEFAULT    (1 << 16)
+
+struct StreamWriter
+{
+    int fd;
+    size_t chunk_length;
+    // Set once a write fails. Everything after that is dropped.
+    bool failed;
+
+    // MUST be last: its static half is allocated inline, after the writer.
+    Array buffer;
+};
+
+struct StreamReader
+{
+    int fd;
+    size_t chunk_capacity;
+    // Set if the stream ended with an error rather than at end of file.
+    bool failed;
+
+    // Holds one chunk: its header, then its elements.
+    char* buffer;
+};
+
+// `w' MUST be allocated in the parent function with the same stub as an
+// Array, where the header is offsetof(StreamWriter, buffer.static_elems)
+// bytes and buffer.static_capacity is set up instead. A `chunk_length' of
+// zero means STREAM_CHUNK_DEFAULT.
+void init(StreamWriter* w, int fd, size_t chunk_length)
+{
+    w->fd = fd;
+    w->chunk_length = chunk_length ? chunk_length : STREAM_CHUNK_DEFAULT;
+    w->failed = false;
+
+    init(&w->buffer);
+
+    // Allocate the dynamic half once, up front; it is reused for every chunk.
+    reserve(&w->buffer, w->chunk_length);
+}
+
+// Writes out whatever is buffered as a (possibly short) chunk. Returns false
+// if this or any earlier write failed.
+bool flush(StreamWriter* w)
+{
+    if(length(&w->buffer) == 0)
+        return !w->failed;
+
+    // Once a write has failed, the stream is broken, so later chunks are
+    // dropped rather than written after a gap. They are still cleared out,
+    // to keep the memory bounded.
+    if(!w->failed && !serialize(&w->buffer, w->fd))
+        w->failed = true;
+
+    // Start over, keeping the dynamic half's allocation for the next chunk.
+    w->buffer.static_length = 0;
+    w->buffer.dynamic_length = 0;
+
+    return !w->failed;
+}
+
+// Appends `v' to the stream, writing out a chunk if that fills one. Returns
+// false once a write has failed.
+bool append(StreamWriter* w, const Value* v)
+{
+    append(&w->buffer, v);
+
+    // FASTPATH
+    if(length(&w->buffer) < w->chunk_length)
+        return !w->failed;
+
+    return flush(w);
+}
+
+// Flushes the last chunk. Returns false if any write failed. The file
+// descriptor is left open.
+bool finish(StreamWriter* w)
+{
+    return flush(w);
+}
+
+// Frees the buffer, dropping anything not yet flushed. Call finish() first.
+void destroy(StreamWriter* w)
+{
+    // The elements have all been written (or dropped), so only the memory is
+    // released, not the elements.
+    w->buffer.static_length = 0;
+    w->buffer.dynamic_length = 0;
+    destroy(&w->buffer);
+}
+
+// Reads exactly `n' bytes, unless the file ends first. Returns the number
+// read, or -1 on an error.
+static ssize_t read_full(int fd, char* buf, size_t n)
+{
+    size_t got = 0;
+
+    while(got < n)
+    {
+        ssize_t r = read(fd, buf + got, n - got);
+        if(r < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if(r == 0)
+            break;
+
+        got += (size_t)r;
+    }
+
+    return (ssize_t)got;
+}
+
+// Reads chunks of up to `chunk_capacity' elements from `fd'. That bounds the
+// reader's memory; a longer chunk is an error. A `chunk_capacity' of zero
+// means STREAM_CHUNK_DEFAULT.
+void init(StreamReader* r, int fd, size_t chunk_capacity)
+{
+    r->fd = fd;
+    r->chunk_capacity = chunk_capacity ? chunk_capacity : STREAM_CHUNK_DEFAULT;
+    r->failed = false;
+
+    // BUG: No OOM checking.
+    r->buffer = malloc(SERIALIZE_HEADER_SIZE + r->chunk_capacity * sizeof(Value));
+}
+
+void destroy(StreamReader* r)
+{
+    free(r->buffer);
+}
+
+// Reads the next chunk, and points `elems' at its `n' elements. They stay
+// valid until the next call. Returns false at the end of the stream, or on an
+// error, which sets r->failed.
+bool next_chunk(StreamReader* r, const Value** elems, size_t* n)
+{
+    if(r->failed)
+        return false;
+
+    ssize_t got = read_full(r->fd, r->buffer, SERIALIZE_HEADER_SIZE);
+
+    // A clean end of file falls between chunks.
+    if(got == 0)
+        return false;
+
+    size_t len;
+    if(got != SERIALIZE_HEADER_SIZE
+    || !check_header(r->buffer, SERIALIZE_HEADER_SIZE, &len)
+    || len > r->chunk_capacity)
+    {
+        r->failed = true;
+        return false;
+    }
+
+    size_t bytes = len * sizeof(Value);
+    if(read_full(r->fd, r->buffer + SERIALIZE_HEADER_SIZE, bytes)
+        != (ssize_t)bytes)
+    {
+        r->failed = true;
+        return false;
+    }
+
+    *elems = (const Value*)(r->buffer + SERIALIZE_HEADER_SIZE);
+    *n = len;
+    return true;
+}
+
+// Calls `iter' on every element of the stream, in order. Returns false if the
+// stream ended with an error rather than at end of file.
+bool foreach(StreamReader* r, void (*iter)(const Value*, void*), void* aux)
+{
+    const Value* elems;
+    size_t n;
+
+    while(next_chunk(r, &elems, &n))
+        for(size_t i = 0; i < n; ++i)
+            iter(elems + i, aux);
+
+    return !r->failed;
+}
@@ -0,0 +1,266 @@
+// unrolled_list.c: Defines NewLang's unrolled linked list type.
+//
+// An unrolled list is a doubly linked list whose nodes each hold a small
+// fixed-capacity array of elements, rather than a single one. Each node is,
+// in effect, the static half of an Array (see array.c): a fixed-size inline
+// buffer plus a length.
+//
+// Compared to List(T) from list.c, which has one element per node:
+//   - Walking the list costs one pointer chase per UNROLLED_NODE_CAPACITY
+//     elements instead of one per element, and the elements in between are
+//     contiguous.
+//   - The per-element overhead of the `next' link disappears.
+//   - Inserting or erasing in the middle (given a cursor) is still O(1)
+//     amortized: at most UNROLLED_NODE_CAPACITY elements are shifted, and
+//     at most one node is split or merged.
+//
+// Nodes are kept at least half full (except for the last one), so the list
+// never uses more than twice the memory of its elements.
+#include <stddef.h>
+#include <stdbool.h>
+
+// The number of elements in each node. A node should span a few cache lines,
+// so that the cost of shifting elements within it stays small next to the
+// cost of the cache miss to reach it.
+#define UNROLLED_NODE_CAPACITY  16
+
+struct UnrolledNode
+{
+    UnrolledNode* next;
+    UnrolledNode* prev;
+    size_t length;
+    Value elems[UNROLLED_NODE_CAPACITY];
+};
+
+struct UnrolledList
+{
+    UnrolledNode* head;
+    UnrolledNode* tail;
+    size_t length;
+};
+
+// A position in the list: element `offset' of `node'. A cursor at the end of
+// the list has node == NULL.
+struct Cursor
+{
+    UnrolledNode* node;
+    size_t offset;
+};
+
+static UnrolledNode* new_node(UnrolledList* l, UnrolledNode* after)
+{
+    // BUG: No OOM checking.
+    UnrolledNode* n = malloc(sizeof(UnrolledNode));
+    n->length = 0;
+
+    n->prev = after;
+    n->next = after ? after->next : l->head;
+
+    if(n->next) n->next->prev = n;
+    else        l->tail = n;
+
+    if(after)   after->next = n;
+    else        l->head = n;
+
+    return n;
+}
+
+static void unlink_node(UnrolledList* l, UnrolledNode* n)
+{
+    if(n->prev) n->prev->next = n->next;
+    else        l->head = n->next;
+
+    if(n->next) n->next->prev = n->prev;
+    else        l->tail = n->prev;
+
+    free(n);
+}
+
+// Moves the upper half of a full node into a new node after it.
+static void split(UnrolledList* l, UnrolledNode* n)
+{
+    UnrolledNode* m = new_node(l, n);
+
+    size_t keep = n->length / 2;
+    m->length = n->length - keep;
+    memcpy(m->elems, n->elems + keep, m->length * sizeof(Value));
+    n->length = keep;
+}
+
+// Restores the half-full invariant on `n' after an erase, by either merging
+// its successor into it, or borrowing from it.
+static void rebalance(UnrolledList* l, UnrolledNode* n)
+{
+    if(n->length >= UNROLLED_NODE_CAPACITY / 2)
+        return;
+
+    UnrolledNode* m = n->next;
+    if(m == NULL)
+    {
+        // The last node may be as empty as it likes, but not empty.
+        if(n->length == 0)
+            unlink_node(l, n);
+        return;
+    }
+
+    if(n->length + m->length <= UNROLLED_NODE_CAPACITY)
+    {
+        memcpy(n->elems + n->length, m->elems, m->length * sizeof(Value));
+        n->length += m->length;
+        unlink_node(l, m);
+    }
+    else
+    {
+        // `m' has more than half a node, so taking one element leaves it at
+        // least half full.
+        n->elems[n->length++] = m->elems[0];
+        memmove(m->elems, m->elems + 1, --m->length * sizeof(Value));
+    }
+}
+
+size_t length(UnrolledList* l)
+{
+    return l->length;
+}
+
+void init(UnrolledList* l)
+{
+    l->head = NULL;
+    l->tail = NULL;
+    l->length = 0;
+}
+
+void destroy(UnrolledList* l)
+{
+    UnrolledNode* n = l->head;
+    while(n)
+    {
+        UnrolledNode* next = n->next;
+
+        destroy_elems(n->elems, n->length);
+
+        free(n);
+        n = next;
+    }
+}
+
+void pcopy(UnrolledList* l)
+{
+    UnrolledNode* src = l->head;
+    init(l);
+
+    for(; src; src = src->next)
+    {
+        UnrolledNode* n = new_node(l, l->tail);
+        n->length = src->length;
+        memcpy(n->elems, src->elems, src->length * sizeof(Value));
+
+        for(size_t i = 0; i < n->length; ++i)
+            pcopy(&n->elems[i]);
+
+        l->length += n->length;
+    }
+}
+
+void append(UnrolledList* l, const Value* v)
+{
+    UnrolledNode* n = l->tail;
+    if(n == NULL || n->length == UNROLLED_NODE_CAPACITY)
+        n = new_node(l, l->tail);
+
+    n->elems[n->length++] = *v;
+    ++l->length;
+}
+
+// Returns a cursor to element `i'. This walks the list, but only touches one
+// node per UNROLLED_NODE_CAPACITY elements.
+Cursor cursor(UnrolledList* l, size_t i)
+{
+    assert(i <= l->length);
+
+    UnrolledNode* n = l->head;
+    while(n && i >= n->length)
+    {
+        i -= n->length;
+        n = n->next;
+    }
+
+    Cursor c = { n, i };
+    return c;
+}
+
+// Moves the cursor forward by one element.
+void advance(Cursor* c)
+{
+    if(++c->offset == c->node->length)
+    {
+        c->node = c->node->next;
+        c->offset = 0;
+    }
+}
+
+Value* index(Cursor c)
+{
+    assert(c.node && c.offset < c.node->length);
+
+    return &c.node->elems[c.offset];
+}
+
+// Inserts `v' before the element at `c' (or at the end, if `c' is at the end)
+// and returns a cursor to the new element. All other cursors into the same
+// node are invalidated.
+Cursor insert(UnrolledList* l, Cursor c, const Value* v)
+{
+    if(c.node == NULL)
+    {
+        append(l, v);
+
+        Cursor end = { l->tail, l->tail->length - 1 };
+        return end;
+    }
+
+    if(c.node->length == UNROLLED_NODE_CAPACITY)
+    {
+        split(l, c.node);
+
+        if(c.offset > c.node->length)
+        {
+            c.offset -= c.node->length;
+            c.node = c.node->next;
+        }
+    }
+
+    UnrolledNode* n = c.node;
+    memmove(n->elems + c.offset + 1, n->elems + c.offset,
+            (n->length - c.offset) * sizeof(Value));
+    n->elems[c.offset] = *v;
+    ++n->length;
+    ++l->length;
+
+    return c;
+}
+
+// Removes the element at `c'. Like array.c's removal functions, this does not
+// call pcopy or any destructors. All cursors into this node and the next one
+// are invalidated.
+Value erase(UnrolledList* l, Cursor c)
+{
+    UnrolledNode* n = c.node;
+    assert(n && c.offset < n->length);
+
+    Value ret = n->elems[c.offset];
+    memmove(n->elems + c.offset, n->elems + c.offset + 1,
+            (n->length - c.offset - 1) * sizeof(Value));
+    --n->length;
+    --l->length;
+
+    rebalance(l, n);
+    return ret;
+}
+
+void foreach(UnrolledList* l, void (*iter)(Value*, void*), void* aux)
+{
+    for(UnrolledNode* n = l->head; n; n = n->next)
+        for(size_t i = 0; i < n->length; ++i)
+            iter(n->elems + i, aux);
+}
@@ -0,0 +1,178 @@
+// unrolled_list_bench.c: Benchmarks UnrolledList against List(T).
+//
+// Both lists are taken through the same phases, with the same elements:
+//
+//   build   - n elements, one at a time.
+//   walk    - sum every element, in order.
+//   insert  - one pass inserting a new element after every element, in the
+//             middle of the list, given a position. This doubles the length.
+//   rewalk  - sum every element again. List(T)'s nodes are now in a
+//             different order in memory than in the list.
+//   drain   - remove every element from the front.
+//
+// List(T) (see list.c) already keeps its nodes packed in a pool, so this
+// measures the unrolled list against the best plain node list we have, not
+// against one malloc per node. Times are per element touched.
+//
+// Build it together with list.c (T as uint64_t, and segmented_array.c with
+// Node as its Value) and unrolled_list.c (Value as uint64_t).
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Roughly how many elements each list is built from, over all repetitions.
+#define BENCH_OPS           (1 << 24)
+
+// The static capacity of the benchmarked List's node pool.
+#define BENCH_STATIC        16
+
+static const size_t BENCH_SIZES[] = { 1 << 10, 1 << 20 };
+
+enum { BUILD, WALK, INSERT, REWALK, DRAIN, PHASES };
+
+static const char* const PHASE_NAMES[PHASES] = {
+    "build", "walk", "insert", "rewalk", "drain",
+};
+
+// Results are summed into here, so the compiler can't drop the walks.
+static volatile uint64_t sink;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Runs every phase once on the empty list `l', adding each one's time to
+// `t'.
+static void run(List* l, size_t n, double* t)
+{
+    uint64_t sum = 0;
+    double start = now();
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        T v = i;
+        push_front(l, &v);
+    }
+    t[BUILD] += now() - start;
+
+    start = now();
+    for(NodeRef r = first(l); r != NIL; r = next(l, r))
+        sum += *value(l, r);
+    t[WALK] += now() - start;
+
+    start = now();
+    for(NodeRef r = first(l); r != NIL; r = next(l, r))
+    {
+        T v = 0;
+        r = insert_after(l, r, &v);
+    }
+    t[INSERT] += now() - start;
+
+    start = now();
+    for(NodeRef r = first(l); r != NIL; r = next(l, r))
+        sum += *value(l, r);
+    t[REWALK] += now() - start;
+
+    start = now();
+    while(length(l) > 0)
+        sum += pop_front(l);
+    t[DRAIN] += now() - start;
+
+    sink += sum;
+}
+
+static void run(UnrolledList* l, size_t n, double* t)
+{
+    uint64_t sum = 0;
+    double start = now();
+
+    for(size_t i = 0; i < n; ++i)
+    {
+        Value v = i;
+        append(l, &v);
+    }
+    t[BUILD] += now() - start;
+
+    start = now();
+    for(Cursor c = cursor(l, 0); c.node; advance(&c))
+        sum += *index(c);
+    t[WALK] += now() - start;
+
+    start = now();
+    for(Cursor c = cursor(l, 0); c.node; advance(&c))
+    {
+        // Step past the element, and insert in front of the one after it
+        // (or at the end).
+        Value v = 0;
+        advance(&c);
+        c = insert(l, c, &v);
+    }
+    t[INSERT] += now() - start;
+
+    start = now();
+    for(Cursor c = cursor(l, 0); c.node; advance(&c))
+        sum += *index(c);
+    t[REWALK] += now() - start;
+
+    start = now();
+    while(length(l) > 0)
+        sum += erase(l, cursor(l, 0));
+    t[DRAIN] += now() - start;
+
+    sink += sum;
+}
+
+static void report(const char* list, size_t n, size_t reps, const double* t)
+{
+    // The phases after the insert pass run over twice as many elements.
+    for(int p = 0; p < PHASES; ++p)
+    {
+        size_t touched = p == REWALK || p == DRAIN ? 2 * n : n;
+
+        printf("%-9s %-7s n=%-8zu %7.2f ns/elem\n", list, PHASE_NAMES[p], n,
+               t[p] * 1e9 / (double)(reps * touched));
+    }
+}
+
+int main(void)
+{
+    for(size_t s = 0; s < sizeof(BENCH_SIZES) / sizeof(BENCH_SIZES[0]); ++s)
+    {
+        size_t n = BENCH_SIZES[s];
+        size_t reps = n < BENCH_OPS ? BENCH_OPS / n : 1;
+
+        double list_t[PHASES] = { 0 };
+        double unrolled_t[PHASES] = { 0 };
+
+        for(size_t r = 0; r < reps; ++r)
+        {
+            // What the stub in array.c does, in C: room for the header and
+            // the pool's static half, with its static_capacity set before
+            // init.
+            _Alignas(List) char storage[sizeof(List)
+                                        + BENCH_STATIC * sizeof(Node)];
+            List* l = (List*)storage;
+            l->nodes.static_capacity = BENCH_STATIC;
+            init(l);
+
+            run(l, n, list_t);
+            destroy(l);
+
+            UnrolledList u;
+            init(&u);
+
+            run(&u, n, unrolled_t);
+            destroy(&u);
+        }
+
+        report("List", n, reps, list_t);
+        report("Unrolled", n, reps, unrolled_t);
+    }
+
+    return 0;
+}